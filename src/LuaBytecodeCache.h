@@ -0,0 +1,219 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// Include after LuaVal.h
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio> // std::rename, std::remove
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "LuaStateTemplate.h"
+
+// Persistent cache of lua_dump output.
+// An entry is keyed by the script path, its size, mtime and content hash and by the Lua build, since
+// the bytecode of luajit and lua 5.1 to 5.4 is not interchangeable. Any mismatch recompiles the
+// script and rewrites the entry. Entries are written to a temporary file and renamed into place,
+// so concurrent processes and threads never see a partial entry. Entries are not synced to disk, so
+// each one ends with the size and hash of its bytecode and a truncated or damaged entry is recompiled.
+class LuaBytecodeCache
+{
+public:
+    struct Stats {
+        std::atomic<size_t> hits{ 0 };
+        std::atomic<size_t> misses{ 0 };
+        std::atomic<size_t> writeFailures{ 0 };
+    };
+
+    // The directory is created if it does not exist
+    explicit LuaBytecodeCache(std::string directory) : directory(std::move(directory))
+    {
+#ifdef _WIN32
+        _mkdir(this->directory.c_str());
+#else
+        mkdir(this->directory.c_str(), 0755);
+#endif
+    }
+
+    // Sets bytecode to the compiled script at path, from the cache when the entry is still valid.
+    // L is a scratch state used to compile on a miss. Returns false and sets error if the script can
+    // not be read or does not compile.
+    bool load(lua_State* L, const std::string& path, const std::string& chunk_name, std::string& bytecode, std::string* error = nullptr)
+    {
+        struct stat info;
+        std::string code;
+        if (stat(path.c_str(), &info) != 0 || !LuaLoaderUtil::readFile(path, code))
+            return LuaLoaderUtil::fail(error, "Can not read " + path);
+
+        std::string header = entryHeader(path, chunk_name, code.size(), static_cast<long long>(info.st_mtime), hash(code));
+        std::string entry_path = entryPath(path);
+        std::string entry;
+        if (LuaLoaderUtil::readFile(entry_path, entry) && entry.compare(0, header.size(), header) == 0 && entryBytecode(entry, header.size(), bytecode))
+        {
+            ++stats.hits;
+            return true;
+        }
+
+        ++stats.misses;
+        if (!LuaStateTemplate::dump(L, code, chunk_name, bytecode, error))
+            return false;
+        if (!writeEntry(entry_path, header, bytecode))
+            ++stats.writeFailures;
+        return true;
+    }
+
+    const Stats& getStats() const { return stats; }
+    const std::string& getDirectory() const { return directory; }
+
+    // Identifies the Lua build the bytecode was produced by.
+    // LUAJIT_VERSION is only defined where luajit.h is included, so the header of a dumped empty chunk
+    // tells luajit and lua 5.1 apart.
+    static const std::string& luaBuild()
+    {
+        static const std::string build = [] {
+            std::string text = LUA_VERSION;
+#ifdef LUAJIT_VERSION
+            text += " " LUAJIT_VERSION;
+#endif
+            text += " " + std::to_string(LUA_VERSION_NUM) + " " + std::to_string(sizeof(void*) * 8) + "bit";
+            std::string bytecode;
+            if (LuaStateTemplate::dump(std::string(), "=build", bytecode))
+            {
+                char hex[3];
+                text += " ";
+                for (size_t i = 0; i < bytecode.size() && i < BUILD_HEADER_SIZE; ++i)
+                {
+                    snprintf(hex, sizeof(hex), "%02x", static_cast<unsigned char>(bytecode[i]));
+                    text += hex;
+                }
+            }
+            return text;
+        }();
+        return build;
+    }
+
+    // FNV-1a
+    static uint64_t hash(const std::string& data)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : data)
+        {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+private:
+    // Leading bytes of a dumped chunk that identify the bytecode format
+    static constexpr size_t BUILD_HEADER_SIZE = 12;
+
+    std::string directory;
+    Stats stats;
+
+    std::string entryPath(const std::string& path) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.luac", static_cast<unsigned long long>(hash(path)));
+        return directory + "/" + name;
+    }
+
+    // Everything the entry depends on, compared byte for byte on lookup
+    static std::string entryHeader(const std::string& path, const std::string& chunk_name, size_t size, long long mtime, uint64_t content_hash)
+    {
+        std::ostringstream header;
+        header << "LuaBytecodeCache 2\n" << luaBuild() << "\n" << path << "\n" << chunk_name << "\n" << size << " " << mtime << " " << content_hash << "\n";
+        return header.str();
+    }
+
+    // Reads the bytecode following the header of an entry, returns false if it does not match its size and hash
+    static bool entryBytecode(const std::string& entry, size_t offset, std::string& bytecode)
+    {
+        size_t line_end = entry.find('\n', offset);
+        if (line_end == std::string::npos)
+            return false;
+        unsigned long long size = 0;
+        unsigned long long content_hash = 0;
+        std::istringstream line(entry.substr(offset, line_end - offset));
+        if (!(line >> size >> content_hash) || entry.size() - line_end - 1 != size)
+            return false;
+        bytecode.assign(entry, line_end + 1, std::string::npos);
+        return hash(bytecode) == content_hash;
+    }
+
+    bool writeEntry(const std::string& entry_path, const std::string& header, const std::string& bytecode) const
+    {
+        std::string checksum = std::to_string(bytecode.size()) + " " + std::to_string(hash(bytecode)) + "\n";
+        static std::atomic<unsigned> counter{ 0 };
+        std::ostringstream temp_path;
+        temp_path << entry_path << "." << processId() << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << "." << counter++ << ".tmp";
+        {
+            std::ofstream file(temp_path.str(), std::ios::binary | std::ios::trunc);
+            file.write(header.data(), header.size());
+            file.write(checksum.data(), checksum.size());
+            file.write(bytecode.data(), bytecode.size());
+            if (!file.flush())
+            {
+                file.close();
+                std::remove(temp_path.str().c_str());
+                return false;
+            }
+        }
+        if (std::rename(temp_path.str().c_str(), entry_path.c_str()) == 0)
+            return true;
+        // Windows does not replace an existing file on rename
+        std::remove(entry_path.c_str());
+        if (std::rename(temp_path.str().c_str(), entry_path.c_str()) == 0)
+            return true;
+        std::remove(temp_path.str().c_str());
+        return false;
+    }
+
+    static long processId()
+    {
+#ifdef _WIN32
+        return _getpid();
+#else
+        return static_cast<long>(getpid());
+#endif
+    }
+};
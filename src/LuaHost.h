@@ -0,0 +1,965 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// Include after LuaVal.h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring> // std::strcmp
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LuaStateTemplate.h"
+
+// Pool of reusable coroutines of one lua state.
+// Every pooled coroutine runs a trampoline that calls the function it is resumed with and then
+// yields a marker followed by the results, waiting for the next function. A coroutine that
+// yields anything else is waiting inside its function, one that fails is dead and dropped.
+class LuaHostCoroutinePool
+{
+public:
+    static constexpr size_t MAX_IDLE = 1024;
+
+    struct Stats {
+        // Coroutines taken from the pool
+        std::atomic<size_t> hits{ 0 };
+        // Coroutines created because the pool was empty
+        std::atomic<size_t> created{ 0 };
+        // Coroutines dropped after an error or because the pool was full
+        std::atomic<size_t> dropped{ 0 };
+        std::atomic<size_t> idle{ 0 };
+    };
+
+    // L must have the coroutine library loaded, stats must outlive the pool
+    LuaHostCoroutinePool(lua_State* L, Stats& stats) : idle(), trampoline(LUA_NOREF), stats(stats)
+    {
+        static const char code[] =
+            "local yield, done = ...\n"
+            "local function run(fn, ...)\n"
+            "    return run(yield(done, fn(...)))\n"
+            "end\n"
+            "return run\n";
+        if (luaL_loadbuffer(L, code, sizeof(code) - 1, "=coroutine pool") != 0)
+            lua_error(L);
+        lua_getglobal(L, "coroutine");
+        lua_getfield(L, -1, "yield");
+        lua_remove(L, -2);
+        lua_pushlightuserdata(L, doneMarker());
+        lua_call(L, 2, 1);
+        trampoline = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    LuaHostCoroutinePool(const LuaHostCoroutinePool&) = delete;
+    LuaHostCoroutinePool& operator=(const LuaHostCoroutinePool&) = delete;
+
+    // Returns a coroutine ready to be resumed with a function and its arguments, ref keeps it alive
+    lua_State* acquire(lua_State* L, int& ref)
+    {
+        if (!idle.empty())
+        {
+            ref = idle.back().ref;
+            lua_State* thread = idle.back().thread;
+            idle.pop_back();
+            stats.idle.store(idle.size(), std::memory_order_relaxed);
+            stats.hits.fetch_add(1, std::memory_order_relaxed);
+            return thread;
+        }
+        lua_State* thread = lua_newthread(L);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, trampoline);
+        lua_xmove(L, thread, 1);
+        // The host resumes its coroutines until they stop waiting
+        LuaValAwait::markAwaitable(L, -1);
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        stats.created.fetch_add(1, std::memory_order_relaxed);
+        return thread;
+    }
+
+    // Returns a coroutine that yielded the done marker to the pool
+    void release(lua_State* L, lua_State* thread, int ref)
+    {
+        lua_settop(thread, 0);
+        if (idle.size() >= MAX_IDLE)
+        {
+            drop(L, ref);
+            return;
+        }
+        idle.push_back({ thread, ref });
+        stats.idle.store(idle.size(), std::memory_order_relaxed);
+    }
+
+    void drop(lua_State* L, int ref)
+    {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        stats.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Whether the values a coroutine yielded mean its function returned
+    static bool isDone(lua_State* thread, int results)
+    {
+        return results >= 1 && lua_touserdata(thread, -results) == doneMarker();
+    }
+
+private:
+    struct Idle {
+        lua_State* thread;
+        int ref;
+    };
+
+    static void* doneMarker()
+    {
+        static char marker;
+        return &marker;
+    }
+
+    std::vector<Idle> idle;
+    int trampoline;
+    Stats& stats;
+};
+
+// Host running lua states on worker threads.
+// Every worker thread owns one state with the standard libraries and LuaVal registered.
+// Jobs run on a worker's thread with its state, so a state is only used by one thread.
+// Jobs posted to a worker stay on it. Tasks are queued on a worker but idle workers steal them,
+// a worker runs its own tasks newest first and thieves take the oldest ones.
+// States share data through locked LuaVal tables, channels and LuaVal.shared.
+// The application ends its frames with tick, which swaps double buffered tables while no job runs.
+// Tasks and coroutines started with LuaHost.go run in pooled coroutines of the worker's state.
+// Their worker resumes them while they wait, see LuaValAwait.
+// Timers created with LuaVal.after and LuaVal.every fire on the worker that created them.
+class LuaHost
+{
+public:
+    typedef std::function<void(lua_State*)> Job;
+    typedef std::function<void(size_t worker, const std::string& message)> ErrorHandler;
+
+    static constexpr size_t NO_WORKER = static_cast<size_t>(-1);
+    static constexpr const char* LUA_GLOBAL_NAME = "LuaHost";
+    // Nested tasks a worker runs while waiting for futures, see Worker::helpOnce
+    static constexpr size_t MAX_HELP_DEPTH = 4;
+    // Interval of resuming waiting coroutines, dispatching timers and flushing combined writes, see hostTick
+    static constexpr std::chrono::milliseconds TICK{ 1 };
+
+    // Lua function run as a task, see spawn.
+    // The function is dumped bytecode, a function in a module loaded with require, or a global function.
+    struct Task {
+        std::string bytecode;
+        std::string module;
+        std::string function;
+        LuaValFuture::Values args;
+    };
+
+    // init runs on every state after it is created, before any other job
+    explicit LuaHost(size_t worker_count = std::thread::hardware_concurrency(), Job init = Job()) :
+        workers(), init(init), sleepMutex(), sleepCv(), stopping(false), queuedTasks(0), nextWorker(0), lastTick(0), tickMutex(), frameMutex(), idleMutex(), idleCv(), pending(0), onError(&printError)
+    {
+        worker_count = std::max<size_t>(worker_count, 1);
+        workers.reserve(worker_count);
+        for (size_t i = 0; i < worker_count; ++i)
+            workers.push_back(std::make_unique<Worker>(*this, i));
+        for (size_t i = 0; i < worker_count; ++i)
+        {
+            if (init)
+                post(i, init);
+            workers[i]->thread = std::thread([this, i] { workerLoop(i); });
+        }
+    }
+
+    // States are initialized from a prepared template, failures go to the error handler
+    LuaHost(size_t worker_count, std::shared_ptr<const LuaStateTemplate> prepared) :
+        LuaHost(worker_count, templateInit(this, std::move(prepared)))
+    {
+    }
+
+    ~LuaHost()
+    {
+        stop();
+    }
+
+    LuaHost(const LuaHost&) = delete;
+    LuaHost& operator=(const LuaHost&) = delete;
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+    // Index of the worker running the calling thread, NO_WORKER for other threads
+    static size_t currentWorker()
+    {
+        return currentIndex();
+    }
+
+    // Called with errors of scripts and tasks run by the host, prints to std::cerr by default
+    void setErrorHandler(ErrorHandler handler)
+    {
+        onError = std::move(handler);
+    }
+
+    // Runs job on the given worker. Jobs run unprotected, lua errors must be caught by the job itself.
+    void post(size_t worker, Job job)
+    {
+        addPending();
+        Worker& w = *workers[worker % workers.size()];
+        {
+            std::lock_guard guard(w.mutex);
+            w.jobs.push_back(std::move(job));
+            w.jobCount.fetch_add(1, std::memory_order_relaxed);
+        }
+        // The target worker has to wake up, others go back to sleep
+        wake(true);
+    }
+
+    void broadcast(const Job& job)
+    {
+        for (size_t i = 0; i < workers.size(); ++i)
+            post(i, job);
+    }
+
+    // Replaces the state of a worker with a new one initialized like the first, after the jobs posted to it so far.
+    // Coroutines, timers, actors and continuations of the old state are dropped with it, see restartState.
+    void restartWorker(size_t worker)
+    {
+        post(worker, [this](lua_State*) {
+            workers[currentWorker()]->restartRequested = true;
+        });
+    }
+
+    // Runs job on any worker. Tasks submitted from a worker are queued on it first.
+    void submit(Job job)
+    {
+        addPending();
+        size_t index = currentWorker();
+        if (index == NO_WORKER)
+            index = nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        Worker& w = *workers[index];
+        {
+            std::lock_guard guard(w.mutex);
+            w.tasks.push_back(std::move(job));
+            queuedTasks.fetch_add(1, std::memory_order_release);
+        }
+        wake(false);
+    }
+
+    // Runs a lua task on any worker, the future receives the values the function returns or its error
+    std::shared_ptr<LuaValFuture::State> spawn(Task task)
+    {
+        auto future = std::make_shared<LuaValFuture::State>();
+        auto shared_task = std::make_shared<Task>(std::move(task));
+        submit([this, future, shared_task](lua_State* L) {
+            int top = lua_gettop(L);
+            lua_pushcfunction(L, &loadTask);
+            lua_pushlightuserdata(L, shared_task.get());
+            if (lua_pcall(L, 1, LUA_MULTRET, 0) != 0)
+            {
+                const char* message = lua_tostring(L, -1);
+                future->fail(message ? message : "(error object is not a string)");
+                lua_pop(L, 1);
+                return;
+            }
+            startCoroutine(L, *workers[currentWorker()], lua_gettop(L) - top, true, [future](lua_State* L, lua_State* thread, bool ok, int results) {
+                if (!ok)
+                {
+                    const char* message = lua_tostring(thread, -1);
+                    future->fail(message ? message : "(error object is not a string)");
+                    return;
+                }
+                LuaValFuture::Values values;
+                if (!lua_checkstack(L, results + 2))
+                {
+                    future->fail("Too many task results");
+                    return;
+                }
+                lua_pushcfunction(L, &collectResults);
+                lua_pushlightuserdata(L, &values);
+                lua_xmove(thread, L, results);
+                if (lua_pcall(L, results + 1, 0, 0) != 0)
+                {
+                    const char* message = lua_tostring(L, -1);
+                    future->fail(message ? message : "(error object is not a string)");
+                    lua_pop(L, 1);
+                    return;
+                }
+                future->complete(std::move(values));
+            });
+        });
+        return future;
+    }
+
+    void runScript(size_t worker, const std::string& code, const std::string& chunk_name = "=host")
+    {
+        post(worker, [this, code, chunk_name](lua_State* L) {
+            if (luaL_loadbuffer(L, code.data(), code.size(), chunk_name.c_str()) != 0 || lua_pcall(L, 0, 0, 0) != 0)
+                reportError(L);
+        });
+    }
+
+    void runScriptOnAll(const std::string& code, const std::string& chunk_name = "=host")
+    {
+        for (size_t i = 0; i < workers.size(); ++i)
+            runScript(i, code, chunk_name);
+    }
+
+    // Reports the error message on top of the stack of the calling worker and pops it
+    void reportError(lua_State* L)
+    {
+        const char* message = lua_tostring(L, -1);
+        onError(currentWorker(), message ? message : "(error object is not a string)");
+        lua_pop(L, 1);
+    }
+
+    // Coroutine pool statistics of a worker, readable from any thread
+    const LuaHostCoroutinePool::Stats& coroutineStats(size_t worker) const
+    {
+        return workers[worker % workers.size()]->poolStats;
+    }
+
+    // Blocks until every job and task queued so far has finished
+    void wait()
+    {
+        std::unique_lock guard(idleMutex);
+        idleCv.wait(guard, [this] { return pending == 0; });
+    }
+
+    // Ends a frame of the application: waits until every worker finished its current job, then flushes
+    // combined writes and swaps the double buffered tables while the workers wait, so no job sees two frames.
+    // Called between frames from a thread that is not a worker of this host. A job waiting for the work
+    // of another worker's job holds up the tick until it finishes.
+    // Returns false without swapping on a worker thread or once the host is stopping.
+    bool tick()
+    {
+        if (currentHost() == this)
+            return false;
+        std::lock_guard frame_guard(frameMutex);
+        {
+            std::lock_guard guard(sleepMutex);
+            if (stopping)
+                return false;
+        }
+        auto barrier = std::make_shared<TickBarrier>();
+        broadcast([barrier](lua_State*) {
+            std::unique_lock guard(barrier->mutex);
+            ++barrier->arrived;
+            barrier->cv.notify_all();
+            barrier->cv.wait(guard, [&] { return barrier->released; });
+        });
+        std::unique_lock guard(barrier->mutex);
+        barrier->cv.wait(guard, [&] { return barrier->arrived == workers.size(); });
+        LuaValWriteCombiner::flushAll();
+        LuaValDoubleBuffer::swapAll();
+        barrier->released = true;
+        guard.unlock();
+        barrier->cv.notify_all();
+        return true;
+    }
+
+    // Finishes the queued work and running coroutines, then closes the states and joins the threads
+    void stop()
+    {
+        {
+            std::lock_guard guard(sleepMutex);
+            stopping = true;
+        }
+        sleepCv.notify_all();
+        for (auto& w : workers)
+        {
+            if (w->thread.joinable())
+                w->thread.join();
+        }
+        for (auto& w : workers)
+            w->executor->detach();
+    }
+
+    // Adds the LuaHost table to L so the state can spawn tasks on this host.
+    // Worker states get it automatically.
+    void registerLua(lua_State* L)
+    {
+        lua_newtable(L);
+        lua_pushstring(L, "spawn");
+        lua_pushlightuserdata(L, this);
+        lua_pushcclosure(L, &Spawn, 1);
+        lua_rawset(L, -3);
+        lua_pushstring(L, "go");
+        lua_pushlightuserdata(L, this);
+        lua_pushcclosure(L, &Go, 1);
+        lua_rawset(L, -3);
+        lua_pushstring(L, "coroutineStats");
+        lua_pushlightuserdata(L, this);
+        lua_pushcclosure(L, &CoroutineStats, 1);
+        lua_rawset(L, -3);
+        lua_pushstring(L, "worker");
+        lua_pushcclosure(L, &CurrentWorker, 0);
+        lua_rawset(L, -3);
+        lua_pushstring(L, "size");
+        lua_pushnumber(L, static_cast<lua_Number>(workers.size()));
+        lua_rawset(L, -3);
+        lua_setglobal(L, LUA_GLOBAL_NAME);
+    }
+
+    // Lua functions
+
+    // LuaHost.spawn(fn, ...) runs fn with copies of the arguments on any worker and returns a future.
+    // fn is a function without upvalues, 'module:function' or the name of a global function.
+    static int Spawn(lua_State* L)
+    {
+        constexpr int target_index = 1;
+        LuaHost* host = static_cast<LuaHost*>(lua_touserdata(L, lua_upvalueindex(1)));
+        Task task;
+        if (lua_isfunction(L, target_index))
+        {
+            if (lua_iscfunction(L, target_index))
+                return luaL_argerror(L, target_index, "C functions can not run as tasks");
+            const char* name;
+            for (int i = 1; (name = lua_getupvalue(L, target_index, i)) != nullptr; ++i)
+            {
+                lua_pop(L, 1);
+                if (std::strcmp(name, "_ENV") != 0)
+                    return luaL_argerror(L, target_index, "Task functions can not have upvalues");
+            }
+            lua_pushvalue(L, target_index);
+            LuaStateTemplate::dump(L, task.bytecode);
+            lua_pop(L, 1);
+        }
+        else
+        {
+            std::string target = luaL_checkstring(L, target_index);
+            size_t separator = target.find(':');
+            if (separator != std::string::npos)
+            {
+                task.module = target.substr(0, separator);
+                task.function = target.substr(separator + 1);
+            }
+            else
+            {
+                task.function = target;
+            }
+        }
+        int top = lua_gettop(L);
+        for (int i = target_index + 1; i <= top; ++i)
+            task.args.push_back(LuaValBase::AsLuaVal(L, i, LOCK_STATUS::NOT_LOCKED));
+        auto future = host->spawn(std::move(task));
+        return LuaValBase::pushLuaVal(L, new LuaValFuture(std::move(future)), LuaValBase::LUAVAL_FUTURE_METATABLE_KEY);
+    }
+
+    // LuaHost.go(fn, ...) runs fn in a new coroutine on the calling worker's state.
+    // The worker resumes it whenever it yields, until it returns.
+    static int Go(lua_State* L)
+    {
+        constexpr int func_index = 1;
+        LuaHost* host = static_cast<LuaHost*>(lua_touserdata(L, lua_upvalueindex(1)));
+        luaL_checktype(L, func_index, LUA_TFUNCTION);
+        size_t index = currentWorker();
+        if (index == NO_WORKER || currentHost() != host)
+            return luaL_error(L, "LuaHost.go can only be used on the worker states of the host");
+        host->startCoroutine(L, *host->workers[index], lua_gettop(L), false, nullptr);
+        return 0;
+    }
+
+    // LuaHost.coroutineStats() returns hits, created, dropped and idle counts of the calling worker's coroutine pool
+    static int CoroutineStats(lua_State* L)
+    {
+        LuaHost* host = static_cast<LuaHost*>(lua_touserdata(L, lua_upvalueindex(1)));
+        size_t index = currentWorker();
+        if (index == NO_WORKER || currentHost() != host)
+            return luaL_error(L, "LuaHost.coroutineStats can only be used on the worker states of the host");
+        const LuaHostCoroutinePool::Stats& stats = host->coroutineStats(index);
+        lua_newtable(L);
+        lua_pushstring(L, "hits");
+        lua_pushnumber(L, static_cast<lua_Number>(stats.hits.load(std::memory_order_relaxed)));
+        lua_rawset(L, -3);
+        lua_pushstring(L, "created");
+        lua_pushnumber(L, static_cast<lua_Number>(stats.created.load(std::memory_order_relaxed)));
+        lua_rawset(L, -3);
+        lua_pushstring(L, "dropped");
+        lua_pushnumber(L, static_cast<lua_Number>(stats.dropped.load(std::memory_order_relaxed)));
+        lua_rawset(L, -3);
+        lua_pushstring(L, "idle");
+        lua_pushnumber(L, static_cast<lua_Number>(stats.idle.load(std::memory_order_relaxed)));
+        lua_rawset(L, -3);
+        return 1;
+    }
+
+    static int CurrentWorker(lua_State* L)
+    {
+        size_t index = currentWorker();
+        if (index == NO_WORKER)
+            lua_pushnil(L);
+        else
+            lua_pushnumber(L, static_cast<lua_Number>(index));
+        return 1;
+    }
+
+private:
+    // Called when a coroutine's function returned or failed, with its results or error message on top of the thread's stack
+    typedef std::function<void(lua_State* L, lua_State* thread, bool ok, int results)> CoroutineDone;
+
+    struct Coroutine {
+        lua_State* thread;
+        // Registry reference of the thread
+        int ref;
+        // Values to resume with, the function and its arguments on the first resume
+        int args;
+        CoroutineDone done;
+    };
+
+    // Posts future continuations to a worker, jobs posted after the host stopped are dropped.
+    // The jobs are tagged with the generation of the worker's state they belong to.
+    struct Executor : public LuaValExecutor {
+        Executor(LuaHost* host, size_t index, uint64_t generation) : host(host), index(index), generation(generation) {
+        }
+
+        void post(Job job) override {
+            std::lock_guard guard(mutex);
+            if (!host)
+                return;
+            host->post(index, [host = host, index = index, generation = generation, job = std::move(job)](lua_State* L) {
+                // Still queued when the worker restarted its state, the job refers to the closed one
+                if (host->workers[index]->generation == generation)
+                    job(L);
+            });
+        }
+
+        // Only called from the worker thread while it runs a job
+        void reportError(lua_State* L) override {
+            std::lock_guard guard(mutex);
+            if (host)
+                host->reportError(L);
+            else
+                lua_pop(L, 1);
+        }
+
+        void detach() override {
+            std::lock_guard guard(mutex);
+            host = nullptr;
+        }
+
+        std::mutex mutex;
+        LuaHost* host;
+        size_t index;
+        uint64_t generation;
+    };
+
+    // Workers wait in a job on it while tick swaps
+    struct TickBarrier {
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t arrived = 0;
+        bool released = false;
+    };
+
+    struct Worker : public LuaValWaitHelper {
+        Worker(LuaHost& host, size_t index) : host(host), index(index), executor(std::make_shared<Executor>(&host, index, 0)) {
+        }
+
+        // Runs queued tasks while a future is waited on, pinned jobs wait for the worker loop.
+        // The tasks run nested in the waiting call on the same state, a task waiting itself nests
+        // further, so past MAX_HELP_DEPTH the wait parks instead.
+        bool helpOnce(lua_State* L) override {
+            if (helpDepth == MAX_HELP_DEPTH)
+                return false;
+            Job job;
+            if (!host.takeTask(index, job))
+                return false;
+            // Jobs catch their own lua errors, see post
+            ++helpDepth;
+            job(L);
+            --helpDepth;
+            host.finishPending();
+            return true;
+        }
+
+        LuaHost& host;
+        size_t index;
+        std::shared_ptr<Executor> executor;
+        std::thread thread;
+        std::mutex mutex;
+        std::deque<Job> jobs;
+        std::deque<Job> tasks;
+        std::atomic<size_t> jobCount{ 0 };
+        // Coroutines of the worker's state waiting to be resumed, only used by the worker thread
+        std::vector<Coroutine> coroutines;
+        std::unique_ptr<LuaHostCoroutinePool> pool;
+        LuaHostCoroutinePool::Stats poolStats;
+        bool restartRequested = false;
+        // Tasks run by helpOnce that are still running, only used by the worker thread
+        size_t helpDepth = 0;
+        // Number of restarts of the worker's state, only used by the worker thread
+        uint64_t generation = 0;
+    };
+
+    static size_t& currentIndex()
+    {
+        thread_local size_t index = NO_WORKER;
+        return index;
+    }
+
+    static Job templateInit(LuaHost* host, std::shared_ptr<const LuaStateTemplate> prepared)
+    {
+        return [host, prepared](lua_State* L) {
+            std::string error;
+            if (!prepared->apply(L, &error))
+                host->onError(currentWorker(), error);
+        };
+    }
+
+    // Closes the worker's state and creates a new one
+    lua_State* restartState(lua_State* L, Worker& w)
+    {
+        std::vector<Coroutine> waiting;
+        waiting.swap(w.coroutines);
+        for (Coroutine& co : waiting)
+        {
+            // Tasks fail their futures
+            if (co.done)
+            {
+                lua_pushstring(co.thread, "Worker state restarted");
+                co.done(L, co.thread, false, 1);
+            }
+            finishPending();
+        }
+        // Closing the state detaches its executor and drops its timers. Continuations and actor drains
+        // its executor already queued are skipped for their generation, other posted jobs run on the new state.
+        w.pool.reset();
+        lua_close(L);
+        ++w.generation;
+        w.executor = std::make_shared<Executor>(this, w.index, w.generation);
+        L = newState();
+        LuaValExecutor::install(L, w.executor);
+        w.pool = std::make_unique<LuaHostCoroutinePool>(L, w.poolStats);
+        if (init)
+            init(L);
+        return L;
+    }
+
+    static LuaHost*& currentHost()
+    {
+        thread_local LuaHost* host = nullptr;
+        return host;
+    }
+
+    static int resumeThread(lua_State* thread, lua_State* from, int args, int& results)
+    {
+#if LUA_VERSION_NUM >= 504
+        return lua_resume(thread, from, args, &results);
+#else
+        // sol's compat layer drops from on 5.1 and LuaJIT
+        int status = lua_resume(thread, from, args);
+        results = lua_gettop(thread);
+        return status;
+#endif
+    }
+
+    // Runs the function and arguments on top of L in a pooled coroutine, right away or from the next tick.
+    // done is called when the function returns or fails, without it errors are reported.
+    void startCoroutine(lua_State* L, Worker& w, int values, bool now, CoroutineDone done)
+    {
+        Coroutine co;
+        co.thread = w.pool->acquire(L, co.ref);
+        lua_xmove(L, co.thread, values);
+        co.args = values;
+        co.done = std::move(done);
+        addPending();
+        if (now)
+            resumeCoroutine(L, w, std::move(co));
+        else
+            w.coroutines.push_back(std::move(co));
+    }
+
+    void resumeCoroutine(lua_State* L, Worker& w, Coroutine co)
+    {
+        int results = 0;
+        int status = resumeThread(co.thread, L, co.args, results);
+        bool ok = status == LUA_YIELD;
+        if (ok && !LuaHostCoroutinePool::isDone(co.thread, results))
+        {
+            // Waiting or yielding to other coroutines, the yielded values are ignored
+            lua_settop(co.thread, 0);
+            co.args = 0;
+            w.coroutines.push_back(std::move(co));
+            return;
+        }
+        if (ok)
+        {
+            // Drop the done marker in front of the results
+            lua_remove(co.thread, -results);
+            --results;
+        }
+        else
+        {
+            results = 1;
+        }
+        if (co.done)
+        {
+            co.done(L, co.thread, ok, results);
+        }
+        else if (!ok)
+        {
+            lua_xmove(co.thread, L, 1);
+            reportError(L);
+        }
+        if (ok)
+            w.pool->release(L, co.thread, co.ref);
+        else
+            w.pool->drop(L, co.ref);
+        finishPending();
+    }
+
+    // Resumes each waiting coroutine once, coroutines that yield again wait for the next round
+    void resumeCoroutines(lua_State* L, Worker& w)
+    {
+        std::vector<Coroutine> waiting;
+        waiting.swap(w.coroutines);
+        for (Coroutine& co : waiting)
+            resumeCoroutine(L, w, std::move(co));
+    }
+
+    static void printError(size_t worker, const std::string& message)
+    {
+        std::cerr << "lua worker " << worker << ": " << message << std::endl;
+    }
+
+    // Pushes the function and arguments of a task, runs under lua_pcall
+    static int loadTask(lua_State* L)
+    {
+        Task& task = *static_cast<Task*>(lua_touserdata(L, 1));
+        lua_settop(L, 0);
+        if (!task.bytecode.empty())
+        {
+            if (luaL_loadbuffer(L, task.bytecode.data(), task.bytecode.size(), "=task") != 0)
+                return lua_error(L);
+        }
+        else if (!task.module.empty())
+        {
+            lua_getglobal(L, "require");
+            lua_pushlstring(L, task.module.data(), task.module.size());
+            lua_call(L, 1, 1);
+            lua_getfield(L, -1, task.function.c_str());
+            lua_remove(L, -2);
+        }
+        else
+        {
+            lua_getglobal(L, task.function.c_str());
+        }
+        if (!lua_isfunction(L, -1))
+            return luaL_error(L, "Task function %s not found", task.function.c_str());
+        luaL_checkstack(L, static_cast<int>(task.args.size()), "Too many task arguments");
+        for (auto& arg : task.args)
+            LuaValBase::pushOwned(L, std::move(arg));
+        return lua_gettop(L);
+    }
+
+    // Converts the results of a task following the Values pointer, runs under lua_pcall
+    static int collectResults(lua_State* L)
+    {
+        LuaValFuture::Values& values = *static_cast<LuaValFuture::Values*>(lua_touserdata(L, 1));
+        int top = lua_gettop(L);
+        for (int i = 2; i <= top; ++i)
+            values.push_back(LuaValBase::AsLuaVal(L, i, LOCK_STATUS::NOT_LOCKED));
+        return 0;
+    }
+
+    lua_State* newState()
+    {
+        lua_State* L = luaL_newstate();
+        luaL_openlibs(L);
+        LuaValBase::registerMetatables(L);
+        registerLua(L);
+        return L;
+    }
+
+    void addPending()
+    {
+        std::lock_guard guard(idleMutex);
+        ++pending;
+    }
+
+    void finishPending()
+    {
+        std::lock_guard guard(idleMutex);
+        if (--pending == 0)
+            idleCv.notify_all();
+    }
+
+    void wake(bool all)
+    {
+        // Taking the mutex orders the wake up after a sleeper checked for work
+        {
+            std::lock_guard guard(sleepMutex);
+        }
+        if (all)
+            sleepCv.notify_all();
+        else
+            sleepCv.notify_one();
+    }
+
+    // Takes the newest task of the worker or steals the oldest task of another worker
+    bool takeTask(size_t index, Job& job)
+    {
+        {
+            Worker& w = *workers[index];
+            std::lock_guard guard(w.mutex);
+            if (!w.tasks.empty())
+            {
+                job = std::move(w.tasks.back());
+                w.tasks.pop_back();
+                queuedTasks.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        if (queuedTasks.load(std::memory_order_acquire) == 0)
+            return false;
+        for (size_t i = 1; i < workers.size(); ++i)
+        {
+            Worker& victim = *workers[(index + i) % workers.size()];
+            std::lock_guard guard(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                job = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queuedTasks.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool takeJob(size_t index, Job& job)
+    {
+        Worker& w = *workers[index];
+        if (w.jobCount.load(std::memory_order_acquire) == 0)
+            return false;
+        std::lock_guard guard(w.mutex);
+        if (w.jobs.empty())
+            return false;
+        job = std::move(w.jobs.front());
+        w.jobs.pop_front();
+        w.jobCount.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Flushes combined writes once per tick for the whole host, on the first worker reaching the tick.
+    // Double buffered tables are swapped by tick, when no worker runs a job.
+    void hostTick(LuaValLockWait::Clock::time_point now, bool force)
+    {
+        int64_t tick = static_cast<int64_t>(now.time_since_epoch() / TICK);
+        int64_t last = lastTick.load(std::memory_order_relaxed);
+        if (!force && (tick <= last || !lastTick.compare_exchange_strong(last, tick, std::memory_order_relaxed)))
+            return;
+        std::lock_guard guard(tickMutex);
+        LuaValWriteCombiner::flushAll();
+    }
+
+    void workerLoop(size_t index)
+    {
+        currentIndex() = index;
+        currentHost() = this;
+        Worker& w = *workers[index];
+        LuaValWaitHelper::current() = &w;
+        lua_State* L = newState();
+        LuaValExecutor::install(L, w.executor);
+        w.pool = std::make_unique<LuaHostCoroutinePool>(L, w.poolStats);
+        LuaValTimers* timers = &LuaValTimers::current(L);
+        auto last_tick = LuaValLockWait::Clock::now();
+        while (true)
+        {
+            Job job;
+            bool ran = takeJob(index, job) || takeTask(index, job);
+            if (ran)
+            {
+                job(L);
+                finishPending();
+                if (w.restartRequested)
+                {
+                    w.restartRequested = false;
+                    L = restartState(L, w);
+                    timers = &LuaValTimers::current(L);
+                }
+            }
+            // Waiting coroutines and timers run once per tick, also while the worker is busy
+            auto now = LuaValLockWait::Clock::now();
+            if (!ran || now - last_tick >= TICK)
+            {
+                last_tick = now;
+                if (!w.coroutines.empty())
+                    resumeCoroutines(L, w);
+                if (timers->size() != 0)
+                    timers->dispatch(L, [this](lua_State* L) { reportError(L); });
+                // A worker going to sleep until new work publishes the writes of its last job
+                hostTick(now, !ran && w.coroutines.empty() && timers->size() == 0);
+            }
+            if (ran)
+                continue;
+            std::unique_lock guard(sleepMutex);
+            auto has_work = [&] {
+                return w.jobCount.load(std::memory_order_acquire) != 0 || queuedTasks.load(std::memory_order_acquire) != 0;
+            };
+            if (has_work())
+                continue;
+            // Pending timers are dropped when the host stops
+            if (stopping && w.coroutines.empty())
+                break;
+            if (!w.coroutines.empty() || timers->size() != 0)
+            {
+                // Waiting coroutines are polled until their resources are ready
+                sleepCv.wait_for(guard, TICK, [&] { return has_work(); });
+                continue;
+            }
+            sleepCv.wait(guard, [&] { return stopping || has_work(); });
+        }
+        w.pool.reset();
+        lua_close(L);
+        LuaValWaitHelper::current() = nullptr;
+        currentHost() = nullptr;
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    Job init;
+    std::mutex sleepMutex;
+    std::condition_variable sleepCv;
+    bool stopping;
+    std::atomic<size_t> queuedTasks;
+    std::atomic<size_t> nextWorker;
+    // Host tick last run by a worker, see hostTick
+    std::atomic<int64_t> lastTick;
+    std::mutex tickMutex;
+    // Held by tick, so one frame ends at a time
+    std::mutex frameMutex;
+    std::mutex idleMutex;
+    std::condition_variable idleCv;
+    size_t pending;
+    ErrorHandler onError;
+};
@@ -0,0 +1,430 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// Include after LuaVal.h
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <functional> // std::function
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LuaHost.h"
+#include "LuaModuleIndex.h"
+
+// Reloads changed scripts into running states.
+// A background thread watches script trees with inotify, recompiles only the files that were
+// written and hands the new chunks to a handler, which swaps them into states at a safe point.
+// Attached to a LuaHost the swap is a job broadcast to every worker, so it runs between other jobs.
+// States are not recreated, shared LuaVal data and everything else in the states is kept.
+// Changed files of a MODULES tree update the module index. Modules a state already required are
+// run again and their new fields are copied into the table in package.loaded, so code holding the
+// old table sees the new functions. Changed files of a SCRIPTS tree are run again, so the states the
+// changes go to must be the ones that ran the tree, such as workers whose template loaded it.
+// States created later from that template, like a restarted LuaHost worker, run the scripts as they
+// were when the template was built. Modules are always loaded from the index and stay up to date.
+// When the kernel drops events because its queue overflowed, the trees are rescanned and the files
+// whose modification time or size changed since they were last seen are reloaded.
+// Only Linux has a watcher, start fails elsewhere.
+class LuaHotReload
+{
+public:
+    enum Kind {
+        SCRIPTS,
+        MODULES,
+    };
+
+    struct Change {
+        Kind kind;
+        std::string root;
+        // Relative to the root, separated with '/'
+        std::string path;
+        // Require name, for modules
+        std::string module;
+        std::string chunkName;
+        std::shared_ptr<const std::string> bytecode;
+    };
+
+    typedef std::shared_ptr<const std::vector<Change>> Changes;
+    typedef std::function<void(const Changes& changes)> Handler;
+    typedef std::function<void(const std::string& message)> ErrorHandler;
+
+    // Quiet time after the last file event before the changed files are compiled
+    static constexpr std::chrono::milliseconds SETTLE{ 50 };
+
+    // Changed modules update index if given, compiles go through cache if given
+    explicit LuaHotReload(std::shared_ptr<LuaModuleIndex> index = nullptr, LuaBytecodeCache* cache = nullptr) :
+        index(std::move(index)), cache(cache), roots(), handler(), onError(&printError), stopping(false), thread(), fd(-1), watches(), stamps()
+    {
+    }
+
+    ~LuaHotReload()
+    {
+        stop();
+    }
+
+    LuaHotReload(const LuaHotReload&) = delete;
+    LuaHotReload& operator=(const LuaHotReload&) = delete;
+
+    // Adds a script tree to watch, call before start
+    void watch(const std::string& root, Kind kind)
+    {
+        roots.push_back({ root, kind });
+    }
+
+    // Called on the watcher thread with every batch of compiled changes
+    void setHandler(Handler changes_handler)
+    {
+        handler = std::move(changes_handler);
+    }
+
+    // Called on the watcher thread with files that do not compile, prints to std::cerr by default
+    void setErrorHandler(ErrorHandler error_handler)
+    {
+        onError = std::move(error_handler);
+    }
+
+    // Broadcasts every batch of changes to the workers of host, which apply them between jobs.
+    // SCRIPTS trees watched this way should be run by the workers, for example through their template.
+    // Stop the watcher before the host.
+    void attach(LuaHost& host)
+    {
+        setHandler([&host](const Changes& changes) {
+            host.broadcast([changes, &host](lua_State* L) {
+                for (const Change& change : *changes)
+                {
+                    std::string error;
+                    if (!apply(L, change, &error))
+                    {
+                        lua_pushstring(L, error.c_str());
+                        host.reportError(L);
+                    }
+                }
+            });
+        });
+    }
+
+    // Starts watching the trees, returns false and sets error if the watcher can not start
+    bool start(std::string* error = nullptr)
+    {
+        stop();
+#ifdef __linux__
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0)
+            return LuaLoaderUtil::fail(error, "Can not create an inotify instance");
+        for (size_t i = 0; i < roots.size(); ++i)
+        {
+            if (!addWatch(i, std::string()))
+            {
+                close(fd);
+                fd = -1;
+                watches.clear();
+                return LuaLoaderUtil::fail(error, "Can not watch " + roots[i].path);
+            }
+            for (const std::string& directory : LuaScriptLoader::findDirectories(roots[i].path))
+                addWatch(i, directory);
+            for (const std::string& script : LuaScriptLoader::findScripts(roots[i].path))
+                stamps[{ i, script }] = stamp(i, script);
+        }
+        stopping = false;
+        thread = std::thread([this] { watchLoop(); });
+        return true;
+#else
+        return LuaLoaderUtil::fail(error, "Hot reload needs inotify, which this platform does not have");
+#endif
+    }
+
+    void stop()
+    {
+        if (!thread.joinable())
+            return;
+        stopping = true;
+        thread.join();
+#ifdef __linux__
+        close(fd);
+#endif
+        fd = -1;
+        watches.clear();
+        stamps.clear();
+    }
+
+    // Swaps one change into L, returns false and sets error if running the new chunk fails
+    static bool apply(lua_State* L, const Change& change, std::string* error = nullptr)
+    {
+        if (change.kind == SCRIPTS)
+            return run(L, change, 0, error);
+
+        lua_getglobal(L, "package");
+        if (lua_istable(L, -1))
+            lua_getfield(L, -1, "loaded");
+        else
+            lua_pushnil(L);
+        if (!lua_istable(L, -1))
+        {
+            lua_pop(L, 2);
+            return true;
+        }
+        lua_getfield(L, -1, change.module.c_str());
+        if (lua_isnil(L, -1))
+        {
+            // Not required yet, require gets the new bytecode from the module index
+            lua_pop(L, 3);
+            return true;
+        }
+        if (!run(L, change, 1, error))
+        {
+            lua_pop(L, 3);
+            return false;
+        }
+        if (lua_istable(L, -2) && lua_istable(L, -1))
+        {
+            lua_pushnil(L);
+            while (lua_next(L, -2) != 0)
+            {
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, -5);
+            }
+            lua_pop(L, 4);
+            return true;
+        }
+        if (lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_pushboolean(L, 1);
+        }
+        lua_setfield(L, -3, change.module.c_str());
+        lua_pop(L, 3);
+        return true;
+    }
+
+private:
+    struct Root {
+        std::string path;
+        Kind kind;
+    };
+
+    struct Watch {
+        size_t root;
+        // Directory relative to the root, empty for the root itself
+        std::string directory;
+    };
+
+    typedef std::pair<size_t, std::string> File;
+    // Modification time in nanoseconds and size of a file, zero if it can not be read
+    typedef std::pair<long long, long long> Stamp;
+
+    std::shared_ptr<LuaModuleIndex> index;
+    LuaBytecodeCache* cache;
+    std::vector<Root> roots;
+    Handler handler;
+    ErrorHandler onError;
+    std::atomic<bool> stopping;
+    std::thread thread;
+    int fd;
+    std::map<int, Watch> watches;
+    // Only used by the watcher thread after start
+    std::map<File, Stamp> stamps;
+
+    // Runs the chunk of a change like require would for modules, leaves results on the stack
+    static bool run(lua_State* L, const Change& change, int results, std::string* error)
+    {
+        int args = 0;
+        if (luaL_loadbuffer(L, change.bytecode->data(), change.bytecode->size(), change.chunkName.c_str()) == 0)
+        {
+            if (change.kind == MODULES)
+            {
+                lua_pushstring(L, change.module.c_str());
+                lua_pushstring(L, change.chunkName.c_str() + 1);
+                args = 2;
+            }
+            if (lua_pcall(L, args, results, 0) == 0)
+                return true;
+        }
+        return LuaLoaderUtil::popError(L, error, "Reloading " + change.chunkName.substr(1) + " failed: ");
+    }
+
+#ifdef __linux__
+    bool addWatch(size_t root, const std::string& directory)
+    {
+        std::string path = directory.empty() ? roots[root].path : roots[root].path + "/" + directory;
+        int wd = inotify_add_watch(fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd < 0)
+            return false;
+        watches[wd] = { root, directory };
+        return true;
+    }
+
+    Stamp stamp(size_t root, const std::string& path) const
+    {
+        struct stat info;
+        if (stat((roots[root].path + "/" + path).c_str(), &info) != 0)
+            return Stamp(0, 0);
+        return Stamp(static_cast<long long>(info.st_mtim.tv_sec) * 1000000000LL + info.st_mtim.tv_nsec, static_cast<long long>(info.st_size));
+    }
+
+    // Collects events until the trees were quiet for SETTLE, then compiles and hands out the changes
+    void watchLoop()
+    {
+        std::set<File> changed;
+        alignas(inotify_event) char buffer[16 * 1024];
+        while (!stopping)
+        {
+            pollfd descriptor{ fd, POLLIN, 0 };
+            int wait_ms = changed.empty() ? 100 : static_cast<int>(SETTLE.count());
+            if (poll(&descriptor, 1, wait_ms) <= 0)
+            {
+                if (!changed.empty())
+                {
+                    for (const File& file : changed)
+                        stamps[file] = stamp(file.first, file.second);
+                    compile(changed);
+                    changed.clear();
+                }
+                continue;
+            }
+            ssize_t length;
+            while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+            {
+                for (char* cursor = buffer; cursor < buffer + length;)
+                {
+                    const inotify_event* event = reinterpret_cast<const inotify_event*>(cursor);
+                    cursor += sizeof(inotify_event) + event->len;
+                    if (event->mask & IN_Q_OVERFLOW)
+                    {
+                        rescan(changed);
+                        continue;
+                    }
+                    auto it = watches.find(event->wd);
+                    if (it == watches.end() || event->len == 0)
+                        continue;
+                    Watch watch = it->second;
+                    std::string path = watch.directory.empty() ? event->name : watch.directory + "/" + event->name;
+                    if (event->mask & IN_ISDIR)
+                    {
+                        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                            addDirectory(watch.root, path, changed);
+                    }
+                    else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && LuaScriptLoader::isScript(event->name))
+                    {
+                        changed.emplace(watch.root, path);
+                    }
+                }
+            }
+        }
+    }
+
+    // Events were dropped, watches directories created meanwhile and finds the scripts that changed
+    void rescan(std::set<File>& changed)
+    {
+        for (size_t root = 0; root < roots.size(); ++root)
+        {
+            addWatch(root, std::string());
+            for (const std::string& directory : LuaScriptLoader::findDirectories(roots[root].path))
+                addWatch(root, directory);
+            for (const std::string& script : LuaScriptLoader::findScripts(roots[root].path))
+            {
+                File file(root, script);
+                auto it = stamps.find(file);
+                if (it == stamps.end() || it->second != stamp(root, script))
+                    changed.insert(file);
+            }
+        }
+    }
+
+    // Files may have been written into a new directory before its watch was added
+    void addDirectory(size_t root, const std::string& directory, std::set<File>& changed)
+    {
+        addWatch(root, directory);
+        std::string path = roots[root].path + "/" + directory;
+        for (const std::string& subdirectory : LuaScriptLoader::findDirectories(path))
+            addWatch(root, directory + "/" + subdirectory);
+        for (const std::string& script : LuaScriptLoader::findScripts(path))
+            changed.emplace(root, directory + "/" + script);
+    }
+#endif
+
+    void compile(const std::set<File>& changed)
+    {
+        std::vector<Change> changes;
+        for (const auto& file : changed)
+        {
+            const Root& root = roots[file.first];
+            changes.push_back({ root.kind, root.path, file.second, LuaScriptLoader::moduleName(file.second), LuaScriptLoader::chunkName(root.path, file.second), nullptr });
+        }
+        std::vector<std::string> errors(changes.size());
+        LuaValThreadPool::instance().parallelFor(changes.size(), [&](size_t i) {
+            lua_State* L = luaL_newstate();
+            if (!L)
+            {
+                errors[i] = "Not enough memory for a scratch state";
+                return;
+            }
+            std::string bytecode;
+            if (LuaScriptLoader::compile(L, changes[i].root, changes[i].path, bytecode, &errors[i], cache))
+                changes[i].bytecode = std::make_shared<const std::string>(std::move(bytecode));
+            lua_close(L);
+        });
+
+        auto compiled = std::make_shared<std::vector<Change>>();
+        for (size_t i = 0; i < changes.size(); ++i)
+        {
+            if (!changes[i].bytecode)
+            {
+                onError(errors[i]);
+                continue;
+            }
+            // Files that are not indexed modules, like new ones, only reload where already required
+            if (changes[i].kind == MODULES && index)
+                index->update(changes[i].root, changes[i].path, changes[i].bytecode);
+            compiled->push_back(std::move(changes[i]));
+        }
+        if (!compiled->empty() && handler)
+            handler(compiled);
+    }
+
+    static void printError(const std::string& message)
+    {
+        std::cerr << message << std::endl;
+    }
+};
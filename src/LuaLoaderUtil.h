@@ -0,0 +1,77 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// Include after LuaVal.h
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Helpers shared by the script loaders, which report errors with a bool result and an optional message
+class LuaLoaderUtil
+{
+public:
+    static bool readFile(const std::string& path, std::string& content)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+        std::ostringstream buffer;
+        buffer << file.rdbuf();
+        content = buffer.str();
+        return true;
+    }
+
+    // Sets error if given and returns false
+    static bool fail(std::string* error, const std::string& message)
+    {
+        if (error)
+            *error = message;
+        return false;
+    }
+
+    // Pops the message of a failed load or call from L, sets error to prefix and the message and returns false
+    static bool popError(lua_State* L, std::string* error, const std::string& prefix = std::string())
+    {
+        const char* message = lua_tostring(L, -1);
+        std::string text = prefix + (message ? message : "(error object is not a string)");
+        lua_pop(L, 1);
+        return fail(error, text);
+    }
+
+    // Loads a chunk and runs it without arguments, returns false and sets error if either fails
+    static bool run(lua_State* L, const char* data, size_t size, const std::string& chunk_name, std::string* error)
+    {
+        if (luaL_loadbuffer(L, data, size, chunk_name.c_str()) != 0 || lua_pcall(L, 0, 0, 0) != 0)
+            return popError(L, error);
+        return true;
+    }
+};
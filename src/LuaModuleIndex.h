@@ -0,0 +1,252 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// Include after LuaVal.h
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "LuaScriptBundle.h"
+
+// Index of the modules of script trees and bundles, built once at startup.
+// install() adds a searcher to package.searchers (package.loaders on 5.1 and luajit) right after the
+// preload searcher. A module of a script tree is compiled on its first require in any state and the
+// bytecode is kept for the other states, a module of a bundle is loaded straight from the mapping.
+// Indexing is not thread safe, afterwards one index can serve states on any thread.
+// The index must outlive the states it is installed in.
+class LuaModuleIndex
+{
+public:
+    LuaModuleIndex() : modules(), bundles(), compiled(0)
+    {
+    }
+
+    LuaModuleIndex(const LuaModuleIndex&) = delete;
+    LuaModuleIndex& operator=(const LuaModuleIndex&) = delete;
+
+    // Indexes the .lua files under root by require name without reading them.
+    // A name indexed earlier is kept. Returns the number of modules added.
+    size_t addTree(const std::string& root, LuaBytecodeCache* cache = nullptr)
+    {
+        size_t added = 0;
+        for (const std::string& path : LuaScriptLoader::findScripts(root))
+        {
+            std::unique_ptr<Module> module(new Module());
+            module->root = root;
+            module->path = path;
+            module->chunkName = LuaScriptLoader::chunkName(root, path);
+            module->cache = cache;
+            if (modules.emplace(LuaScriptLoader::moduleName(path), std::move(module)).second)
+                ++added;
+        }
+        return added;
+    }
+
+    // Indexes the entries of an open bundle by require name.
+    // A name indexed earlier is kept. Returns the number of modules added.
+    size_t addBundle(std::shared_ptr<const LuaScriptBundle> bundle)
+    {
+        size_t added = 0;
+        for (const LuaScriptBundle::Entry& entry : bundle->entries())
+        {
+            std::unique_ptr<Module> module(new Module());
+            module->chunkName = entry.chunkName;
+            module->entry = &entry;
+            if (modules.emplace(LuaScriptLoader::moduleName(entry.path), std::move(module)).second)
+                ++added;
+        }
+        bundles.push_back(std::move(bundle));
+        return added;
+    }
+
+    bool contains(const std::string& name) const { return modules.find(name) != modules.end(); }
+    size_t size() const { return modules.size(); }
+    // Modules compiled from source so far
+    size_t compiledCount() const { return compiled.load(); }
+
+    // Pushes the chunk of a module, compiling it on first use.
+    // Returns false and sets error if the module is not indexed or does not compile.
+    bool load(lua_State* L, const std::string& name, std::string* error = nullptr)
+    {
+        auto it = modules.find(name);
+        if (it == modules.end())
+            return LuaLoaderUtil::fail(error, "Module " + name + " is not indexed");
+        Module& module = *it->second;
+        if (module.entry)
+            return LuaScriptBundle::load(L, *module.entry, error);
+
+        // loadChunk is pushed before bytecode exists and runs under lua_pcall, so no lua error skips the destructor of bytecode
+        lua_pushcfunction(L, &loadChunk);
+        std::shared_ptr<const std::string> bytecode;
+        {
+            // Compiles once while other states requiring the same module wait for it
+            std::lock_guard<std::mutex> lock(module.mutex);
+            if (!module.bytecode)
+            {
+                std::string compiled_bytecode;
+                lua_State* scratch = luaL_newstate();
+                if (!scratch)
+                {
+                    lua_pop(L, 1);
+                    return LuaLoaderUtil::fail(error, "Not enough memory for a scratch state");
+                }
+                bool ok = LuaScriptLoader::compile(scratch, module.root, module.path, compiled_bytecode, error, module.cache);
+                lua_close(scratch);
+                if (!ok)
+                {
+                    lua_pop(L, 1);
+                    return false;
+                }
+                module.bytecode = std::make_shared<const std::string>(std::move(compiled_bytecode));
+                ++compiled;
+            }
+            bytecode = module.bytecode;
+        }
+        Chunk chunk{ bytecode->data(), bytecode->size(), module.chunkName.c_str() };
+        lua_pushlightuserdata(L, &chunk);
+        if (lua_pcall(L, 1, 1, 0) == 0)
+            return true;
+        return LuaLoaderUtil::popError(L, error);
+    }
+
+    // Replaces the bytecode of the tree module for root and path, later requires load the new version.
+    // Returns false if that file is not an indexed module.
+    bool update(const std::string& root, const std::string& path, std::shared_ptr<const std::string> bytecode)
+    {
+        auto it = modules.find(LuaScriptLoader::moduleName(path));
+        if (it == modules.end() || it->second->entry || it->second->root != root || it->second->path != path)
+            return false;
+        std::lock_guard<std::mutex> lock(it->second->mutex);
+        it->second->bytecode = std::move(bytecode);
+        return true;
+    }
+
+    // Adds the index searcher to package.searchers of L
+    bool install(lua_State* L, std::string* error = nullptr)
+    {
+        lua_getglobal(L, "package");
+        if (!lua_istable(L, -1))
+        {
+            lua_pop(L, 1);
+            return LuaLoaderUtil::fail(error, "package is not available for the module index");
+        }
+        lua_getfield(L, -1, "searchers");
+        if (!lua_istable(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_getfield(L, -1, "loaders");
+        }
+        if (!lua_istable(L, -1))
+        {
+            lua_pop(L, 2);
+            return LuaLoaderUtil::fail(error, "package.searchers is not available for the module index");
+        }
+#if LUA_VERSION_NUM >= 502
+        int count = static_cast<int>(lua_rawlen(L, -1));
+#else
+        int count = static_cast<int>(lua_objlen(L, -1));
+#endif
+        // After the preload searcher so package.preload keeps precedence
+        int position = count > 0 ? 2 : 1;
+        for (int i = count; i >= position; --i)
+        {
+            lua_rawgeti(L, -1, i);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_pushlightuserdata(L, this);
+        lua_pushcclosure(L, &Search, 1);
+        lua_rawseti(L, -2, position);
+        lua_pop(L, 2);
+        return true;
+    }
+
+private:
+    struct Module {
+        // Script tree modules
+        std::string root;
+        std::string path;
+        LuaBytecodeCache* cache = nullptr;
+        std::mutex mutex;
+        std::shared_ptr<const std::string> bytecode;
+        // Bundle modules
+        const LuaScriptBundle::Entry* entry = nullptr;
+
+        std::string chunkName;
+    };
+
+    struct Chunk {
+        const char* data;
+        size_t size;
+        const char* name;
+    };
+
+    std::unordered_map<std::string, std::unique_ptr<Module>> modules;
+    std::vector<std::shared_ptr<const LuaScriptBundle>> bundles;
+    std::atomic<size_t> compiled;
+
+    // Pushes the chunk the Chunk pointer at index 1 describes, runs under lua_pcall
+    static int loadChunk(lua_State* L)
+    {
+        const Chunk& chunk = *static_cast<const Chunk*>(lua_touserdata(L, 1));
+        if (luaL_loadbuffer(L, chunk.data, chunk.size, chunk.name) != 0)
+            return lua_error(L);
+        return 1;
+    }
+
+    // Searcher protocol: returns the loader and the module source, or a message when not indexed
+    static int Search(lua_State* L)
+    {
+        LuaModuleIndex* index = (LuaModuleIndex*)lua_touserdata(L, lua_upvalueindex(1));
+        const char* name = luaL_checkstring(L, 1);
+        auto it = index->modules.find(name);
+        if (it == index->modules.end())
+        {
+            lua_pushfstring(L, "\n\tno module '%s' in the module index", name);
+            return 1;
+        }
+        const char* source = it->second->chunkName.c_str() + 1;
+        bool loaded;
+        {
+            std::string error;
+            loaded = index->load(L, name, &error);
+            if (!loaded)
+                lua_pushfstring(L, "error loading module '%s' from '%s':\n\t%s", name, source, error.c_str());
+        }
+        if (!loaded)
+            return lua_error(L);
+        lua_pushstring(L, source);
+        return 2;
+    }
+};
@@ -0,0 +1,360 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// Include after LuaVal.h
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm> // std::lower_bound
+#include <cstdint>
+#include <cstdio> // std::rename, std::remove
+#include <cstring> // std::memcpy
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "LuaScriptLoader.h"
+
+// Single file holding the bytecode of a whole script tree.
+// Layout, integers in native byte order:
+//   "LUAB" u32 format, u32 build length, build (LuaBytecodeCache::luaBuild()), u32 entry count
+//   per entry: u32 path length, path, u32 chunk name length, chunk name, u64 offset, u64 size
+//   bytecode of every entry, offsets relative to the start of the file
+// Entries are sorted by path. The file is mapped into memory and the bytecode is fed to lua_load
+// without copying it.
+class LuaScriptBundle
+{
+public:
+    static constexpr uint32_t FORMAT = 1;
+
+    struct Entry {
+        // Relative to the script root, separated with '/'
+        std::string path;
+        std::string chunkName;
+        const char* data;
+        size_t size;
+    };
+
+    LuaScriptBundle() = default;
+    LuaScriptBundle(const LuaScriptBundle&) = delete;
+    LuaScriptBundle& operator=(const LuaScriptBundle&) = delete;
+    ~LuaScriptBundle() { close(); }
+
+    // Compiles the script tree under root in parallel and writes it to file.
+    // The file is written under a temporary name and renamed into place.
+    static bool build(const std::string& root, const std::string& file, std::string* error = nullptr, LuaBytecodeCache* cache = nullptr)
+    {
+        std::vector<LuaScriptLoader::Script> scripts = LuaScriptLoader::compileTree(root, cache);
+        for (const auto& script : scripts)
+        {
+            if (!script.error.empty())
+                return LuaLoaderUtil::fail(error, script.error);
+        }
+
+        std::string build = LuaBytecodeCache::luaBuild();
+        std::string index;
+        index.append("LUAB", 4);
+        append32(index, FORMAT);
+        appendString(index, build);
+        append32(index, static_cast<uint32_t>(scripts.size()));
+        size_t index_size = index.size();
+        for (const auto& script : scripts)
+            index_size += 4 + script.path.size() + 4 + script.chunkName.size() + 16;
+        uint64_t offset = index_size;
+        for (const auto& script : scripts)
+        {
+            appendString(index, script.path);
+            appendString(index, script.chunkName);
+            append64(index, offset);
+            append64(index, script.bytecode.size());
+            offset += script.bytecode.size();
+        }
+
+        std::string temp_file = file + ".tmp";
+        {
+            std::ofstream out(temp_file, std::ios::binary | std::ios::trunc);
+            out.write(index.data(), index.size());
+            for (const auto& script : scripts)
+                out.write(script.bytecode.data(), script.bytecode.size());
+            if (!out.flush())
+            {
+                out.close();
+                std::remove(temp_file.c_str());
+                return LuaLoaderUtil::fail(error, "Can not write " + temp_file);
+            }
+        }
+        // Windows does not replace an existing file on rename
+        if (std::rename(temp_file.c_str(), file.c_str()) != 0 && (std::remove(file.c_str()), std::rename(temp_file.c_str(), file.c_str())) != 0)
+        {
+            std::remove(temp_file.c_str());
+            return LuaLoaderUtil::fail(error, "Can not replace " + file);
+        }
+        return true;
+    }
+
+    // Maps the bundle and reads its index. The bundle must have been built for the same Lua build.
+    bool open(const std::string& file, std::string* error = nullptr)
+    {
+        close();
+        if (!map(file))
+            return LuaLoaderUtil::fail(error, "Can not map " + file);
+        if (!readIndex())
+        {
+            close();
+            return LuaLoaderUtil::fail(error, file + " is not a bundle for " + LuaBytecodeCache::luaBuild());
+        }
+        return true;
+    }
+
+    void close()
+    {
+        index.clear();
+        modules.clear();
+        unmap();
+    }
+
+    bool isOpen() const { return base != nullptr; }
+
+    // Entries sorted by path
+    const std::vector<Entry>& entries() const { return index; }
+
+    const Entry* find(const std::string& path) const
+    {
+        auto it = std::lower_bound(index.begin(), index.end(), path, [](const Entry& entry, const std::string& key) { return entry.path < key; });
+        if (it == index.end() || it->path != path)
+            return nullptr;
+        return &*it;
+    }
+
+    // Finds a module by its require name, see LuaScriptLoader::moduleName
+    const Entry* findModule(const std::string& name) const
+    {
+        auto it = modules.find(name);
+        if (it == modules.end())
+            return nullptr;
+        return &index[it->second];
+    }
+
+    // Pushes the chunk of an entry, reading the bytecode straight from the mapping
+    static bool load(lua_State* L, const Entry& entry, std::string* error = nullptr)
+    {
+        Reader reader{ entry.data, entry.size };
+        // sol's compat layer takes the mode argument on every version
+        int status = lua_load(L, &Reader::read, &reader, entry.chunkName.c_str(), "b");
+        if (status == 0)
+            return true;
+        return LuaLoaderUtil::popError(L, error);
+    }
+
+    // Runs every entry on L in path order, returns false and sets error at the first one that fails
+    bool run(lua_State* L, std::string* error = nullptr) const
+    {
+        for (const Entry& entry : index)
+        {
+            if (!load(L, entry, error))
+                return false;
+            if (lua_pcall(L, 0, 0, 0) != 0)
+                return LuaLoaderUtil::popError(L, error);
+        }
+        return true;
+    }
+
+    // Adds every entry to a template in path order, so every state created from it runs them.
+    // The bytecode is copied, the bundle can be closed afterwards.
+    void addTo(LuaStateTemplate& target) const
+    {
+        for (const Entry& entry : index)
+            target.addScriptBytecode({ entry.chunkName, std::string(entry.data, entry.size) });
+    }
+
+private:
+    // Hands the whole chunk to lua_load in one piece
+    struct Reader {
+        const char* data;
+        size_t size;
+
+        static const char* read(lua_State*, void* ud, size_t* size)
+        {
+            Reader* reader = static_cast<Reader*>(ud);
+            *size = reader->size;
+            reader->size = 0;
+            return *size ? reader->data : nullptr;
+        }
+    };
+
+    const char* base = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+#endif
+    std::vector<Entry> index;
+    std::unordered_map<std::string, size_t> modules;
+
+    bool map(const std::string& file)
+    {
+#ifdef _WIN32
+        HANDLE handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+            mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(handle);
+        if (!mapping)
+            return false;
+        base = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!base)
+        {
+            CloseHandle(mapping);
+            mapping = nullptr;
+            return false;
+        }
+        length = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        void* address = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+            address = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED)
+            return false;
+        // The index and every chunk are read front to back
+        madvise(address, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+        base = static_cast<const char*>(address);
+        length = static_cast<size_t>(info.st_size);
+#endif
+        return true;
+    }
+
+    void unmap()
+    {
+        if (!base)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(base);
+        CloseHandle(mapping);
+        mapping = nullptr;
+#else
+        munmap(const_cast<char*>(base), length);
+#endif
+        base = nullptr;
+        length = 0;
+    }
+
+    bool readIndex()
+    {
+        size_t cursor = 0;
+        uint32_t format, count;
+        std::string magic, build;
+        if (!readBytes(cursor, 4, magic) || magic != "LUAB" || !read32(cursor, format) || format != FORMAT)
+            return false;
+        if (!readString(cursor, build) || build != LuaBytecodeCache::luaBuild() || !read32(cursor, count))
+            return false;
+        index.reserve(count);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            Entry entry;
+            uint64_t offset, size;
+            if (!readString(cursor, entry.path) || !readString(cursor, entry.chunkName) || !read64(cursor, offset) || !read64(cursor, size))
+                return false;
+            if (offset > length || size > length - offset)
+                return false;
+            if (!index.empty() && !(index.back().path < entry.path))
+                return false;
+            entry.data = base + offset;
+            entry.size = static_cast<size_t>(size);
+            modules.emplace(LuaScriptLoader::moduleName(entry.path), index.size());
+            index.push_back(std::move(entry));
+        }
+        return true;
+    }
+
+    bool readBytes(size_t& cursor, size_t count, std::string& out) const
+    {
+        if (count > length - cursor)
+            return false;
+        out.assign(base + cursor, count);
+        cursor += count;
+        return true;
+    }
+
+    bool read32(size_t& cursor, uint32_t& value) const
+    {
+        if (4 > length - cursor)
+            return false;
+        std::memcpy(&value, base + cursor, 4);
+        cursor += 4;
+        return true;
+    }
+
+    bool read64(size_t& cursor, uint64_t& value) const
+    {
+        if (8 > length - cursor)
+            return false;
+        std::memcpy(&value, base + cursor, 8);
+        cursor += 8;
+        return true;
+    }
+
+    bool readString(size_t& cursor, std::string& out) const
+    {
+        uint32_t size;
+        return read32(cursor, size) && readBytes(cursor, size, out);
+    }
+
+    static void append32(std::string& out, uint32_t value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), 4);
+    }
+
+    static void append64(std::string& out, uint64_t value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), 8);
+    }
+
+    static void appendString(std::string& out, const std::string& value)
+    {
+        append32(out, static_cast<uint32_t>(value.size()));
+        out.append(value);
+    }
+};
@@ -0,0 +1,228 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// Include after LuaVal.h
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm> // std::sort, std::replace
+#include <set>
+#include <string>
+#include <vector>
+
+#include "LuaBytecodeCache.h"
+#include "LuaStateTemplate.h"
+
+// Loads the lua scripts of a directory tree.
+// Files are found with dirent, then read and compiled to bytecode in parallel on LuaValThreadPool,
+// each batch of files sharing one scratch state. The compiled scripts are kept in path order so
+// every state runs them in the same order no matter which compile finished first.
+class LuaScriptLoader
+{
+public:
+    struct Script {
+        // Relative to the root, separated with '/'
+        std::string path;
+        // See chunkName
+        std::string chunkName;
+        std::string bytecode;
+        // Set when the file could not be read or compiled
+        std::string error;
+    };
+
+    // Files compiled with one scratch state
+    static constexpr size_t FILES_PER_BATCH = 16;
+
+    // Relative paths of the .lua files under root, sorted
+    static std::vector<std::string> findScripts(const std::string& root)
+    {
+        std::vector<std::string> paths;
+        Visited visited;
+        if (visit(root, visited))
+            walk(root, std::string(), visited, &paths, nullptr);
+        std::sort(paths.begin(), paths.end());
+        return paths;
+    }
+
+    // Relative paths of the directories under root, sorted
+    static std::vector<std::string> findDirectories(const std::string& root)
+    {
+        std::vector<std::string> directories;
+        Visited visited;
+        if (visit(root, visited))
+            walk(root, std::string(), visited, nullptr, &directories);
+        std::sort(directories.begin(), directories.end());
+        return directories;
+    }
+
+    // Reads and compiles the .lua files under root in parallel, reusing up to date bytecode from cache if given
+    static std::vector<Script> compileTree(const std::string& root, LuaBytecodeCache* cache = nullptr)
+    {
+        std::vector<Script> scripts;
+        for (auto& path : findScripts(root))
+        {
+            std::string chunk_name = chunkName(root, path);
+            scripts.push_back({ std::move(path), std::move(chunk_name), std::string(), std::string() });
+        }
+        size_t batches = (scripts.size() + FILES_PER_BATCH - 1) / FILES_PER_BATCH;
+        LuaValThreadPool::instance().parallelFor(batches, [&](size_t batch) {
+            lua_State* L = luaL_newstate();
+            size_t last = (std::min)(scripts.size(), (batch + 1) * FILES_PER_BATCH);
+            for (size_t i = batch * FILES_PER_BATCH; i < last; ++i)
+            {
+                Script& script = scripts[i];
+                if (!L)
+                    script.error = "Not enough memory for a scratch state";
+                else
+                    compile(L, root, script.path, script.bytecode, &script.error, cache);
+            }
+            if (L)
+                lua_close(L);
+        });
+        return scripts;
+    }
+
+    // Compiles one script under root with the scratch state L, through cache if given
+    static bool compile(lua_State* L, const std::string& root, const std::string& path, std::string& bytecode, std::string* error = nullptr, LuaBytecodeCache* cache = nullptr)
+    {
+        if (cache)
+            return cache->load(L, root + "/" + path, chunkName(root, path), bytecode, error);
+        std::string code;
+        if (!LuaLoaderUtil::readFile(root + "/" + path, code))
+            return LuaLoaderUtil::fail(error, "Can not read " + root + "/" + path);
+        return LuaStateTemplate::dump(L, code, chunkName(root, path), bytecode, error);
+    }
+
+    // Runs the scripts on L in order, returns false and sets error at the first one that fails
+    static bool run(lua_State* L, const std::vector<Script>& scripts, std::string* error = nullptr)
+    {
+        for (const Script& script : scripts)
+        {
+            if (!script.error.empty())
+                return LuaLoaderUtil::fail(error, script.error);
+            if (!LuaLoaderUtil::run(L, script.bytecode.data(), script.bytecode.size(), script.chunkName, error))
+                return false;
+        }
+        return true;
+    }
+
+    // Adds the scripts under root to a template in path order, so every state created from it runs them.
+    // Returns false and sets error if a script does not compile.
+    static bool addTree(const std::string& root, LuaStateTemplate& target, std::string* error = nullptr, LuaBytecodeCache* cache = nullptr)
+    {
+        std::vector<Script> scripts = compileTree(root, cache);
+        for (const Script& script : scripts)
+        {
+            if (!script.error.empty())
+                return LuaLoaderUtil::fail(error, script.error);
+        }
+        for (Script& script : scripts)
+            target.addScriptBytecode({ script.chunkName, std::move(script.bytecode) });
+        return true;
+    }
+
+    static bool isScript(const std::string& name)
+    {
+        return name.size() > 4 && name.compare(name.size() - 4, 4, ".lua") == 0;
+    }
+
+    // Chunk name of a script, what error messages and debug info show as its source
+    static std::string chunkName(const std::string& root, const std::string& path)
+    {
+        return "@" + root + "/" + path;
+    }
+
+    // The require name of a script: a/b/c.lua is a.b.c and a/init.lua is a
+    static std::string moduleName(const std::string& path)
+    {
+        std::string name = path.substr(0, path.size() - 4);
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, "/init") == 0)
+            name.resize(name.size() - 5);
+        std::replace(name.begin(), name.end(), '/', '.');
+        return name;
+    }
+
+private:
+    // Device and inode of the directories walked so far, so symbolic links that loop back
+    // into the tree or lead to a directory twice are not followed
+    typedef std::set<std::pair<unsigned long long, unsigned long long>> Visited;
+
+    // Returns false if the directory at path can not be found or was walked already
+    static bool visit(const std::string& path, Visited& visited)
+    {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            return false;
+        // File systems without inode numbers report 0, their directories are not tracked
+        if (info.st_ino == 0)
+            return true;
+        return visited.insert({ static_cast<unsigned long long>(info.st_dev), static_cast<unsigned long long>(info.st_ino) }).second;
+    }
+
+    static void walk(const std::string& root, const std::string& relative, Visited& visited, std::vector<std::string>* paths, std::vector<std::string>* directories)
+    {
+        std::string directory = relative.empty() ? root : root + "/" + relative;
+        DIR* dir = opendir(directory.c_str());
+        if (!dir)
+            return;
+        while (dirent* entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
+            std::string path = relative.empty() ? name : relative + "/" + name;
+            bool is_dir = entry->d_type == DT_DIR;
+            bool is_file = entry->d_type == DT_REG;
+            bool is_link = entry->d_type == DT_LNK;
+            if (entry->d_type == DT_UNKNOWN || is_link)
+            {
+                // Some file systems do not fill in the type, links are resolved to their target
+                struct stat info;
+                if (stat((root + "/" + path).c_str(), &info) != 0)
+                    continue;
+                is_dir = S_ISDIR(info.st_mode);
+                is_file = S_ISREG(info.st_mode);
+            }
+            if (is_dir)
+            {
+                if (!visit(root + "/" + path, visited))
+                    continue;
+                if (directories)
+                    directories->push_back(path);
+                walk(root, path, visited, paths, directories);
+            }
+            else if (paths && is_file && isScript(name))
+                paths->push_back(path);
+        }
+        closedir(dir);
+    }
+};
@@ -0,0 +1,293 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+// Include after LuaVal.h
+
+#include <functional> // std::function
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "LuaLoaderUtil.h"
+
+// Prepared initialization for new lua states.
+// Init scripts and modules are compiled once to bytecode in a scratch state, new states replay the
+// bytecode instead of parsing the sources again. Modules are registered in package.preload so
+// require runs them without searching the file system, scripts run in the order they were added.
+// Config values are evaluated once and frozen, each state gets its own plain lua copy in a global.
+// A template is only read after it is prepared, so one template can initialize states on any thread.
+class LuaStateTemplate
+{
+public:
+    struct Chunk {
+        std::string name;
+        std::string bytecode;
+    };
+
+    struct Config {
+        std::string name;
+        std::shared_ptr<LuaValBase> value;
+    };
+
+    // Native setup run on every state before the modules and scripts, for example installing a package searcher
+    typedef std::function<bool(lua_State* L, std::string* error)> Setup;
+
+    LuaStateTemplate() : scripts(), modules(), configs(), setups()
+    {
+    }
+
+    // Evaluates code once in a scratch state and stores the value it returns as the global name of new states
+    bool addConfig(const std::string& name, const std::string& code, std::string* error = nullptr)
+    {
+        lua_State* L = luaL_newstate();
+        if (!L)
+            return LuaLoaderUtil::fail(error, "Not enough memory for a scratch state");
+        luaL_openlibs(L);
+        LuaValBase::registerMetatables(L);
+        std::unique_ptr<LuaValBase> value;
+        bool evaluated = luaL_loadbuffer(L, code.data(), code.size(), ("=" + name).c_str()) == 0 && lua_pcall(L, 0, 1, 0) == 0;
+        if (evaluated)
+        {
+            lua_pushcfunction(L, &convertConfig);
+            lua_insert(L, -2);
+            lua_pushlightuserdata(L, &value);
+            evaluated = lua_pcall(L, 2, 0, 0) == 0;
+        }
+        if (!evaluated && error)
+            *error = lua_tostring(L, -1);
+        lua_close(L);
+        if (evaluated)
+            addConfigValue(name, std::move(value));
+        return evaluated;
+    }
+
+    // Stores a frozen config value, nil values are not set.
+    // The value must not be changed afterwards since states copy it concurrently.
+    void addConfigValue(const std::string& name, std::unique_ptr<LuaValBase> value)
+    {
+        configs.push_back({ name, std::shared_ptr<LuaValBase>(std::move(value)) });
+    }
+
+    // Compiles a script run by every new state, returns false and sets error if it does not compile
+    bool addScript(const std::string& code, const std::string& chunk_name, std::string* error = nullptr)
+    {
+        return compile(code, chunk_name, scripts, error);
+    }
+
+    // Compiles a module that new states can require by name
+    bool addModule(const std::string& name, const std::string& code, std::string* error = nullptr)
+    {
+        if (!compile(code, "=" + name, modules, error))
+            return false;
+        modules.back().name = name;
+        return true;
+    }
+
+    void addScriptBytecode(Chunk chunk)
+    {
+        scripts.push_back(std::move(chunk));
+    }
+
+    void addModuleBytecode(Chunk chunk)
+    {
+        modules.push_back(std::move(chunk));
+    }
+
+    void addSetup(Setup setup)
+    {
+        setups.push_back(std::move(setup));
+    }
+
+    // Registers the modules and runs the scripts on L.
+    // Returns false and sets error when a script fails, the following scripts do not run.
+    bool apply(lua_State* L, std::string* error = nullptr) const
+    {
+        for (const Config& config : configs)
+        {
+            if (!config.value)
+                continue;
+            // Full depth copy, tables become plain lua tables
+            config.value->pushAsLua(L, 0);
+            lua_setglobal(L, config.name.c_str());
+        }
+        for (const Setup& setup : setups)
+        {
+            if (!setup(L, error))
+                return false;
+        }
+        if (!modules.empty())
+        {
+            lua_getglobal(L, "package");
+            if (lua_istable(L, -1))
+                lua_getfield(L, -1, "preload");
+            else
+                lua_pushnil(L);
+            if (!lua_istable(L, -1))
+            {
+                lua_pop(L, 2);
+                return LuaLoaderUtil::fail(error, "package.preload is not available for template modules");
+            }
+            for (const Chunk& module : modules)
+            {
+                if (luaL_loadbuffer(L, module.bytecode.data(), module.bytecode.size(), ("=" + module.name).c_str()) != 0)
+                {
+                    std::string message = lua_tostring(L, -1);
+                    lua_pop(L, 3);
+                    return LuaLoaderUtil::fail(error, message);
+                }
+                lua_setfield(L, -2, module.name.c_str());
+            }
+            lua_pop(L, 2);
+        }
+        for (const Chunk& script : scripts)
+        {
+            if (!LuaLoaderUtil::run(L, script.bytecode.data(), script.bytecode.size(), script.name, error))
+                return false;
+        }
+        return true;
+    }
+
+    // Creates a state with the standard libraries and LuaVal registered and applies the template.
+    // Returns nullptr and sets error if the state can not be created or applying fails.
+    lua_State* newState(std::string* error = nullptr) const
+    {
+        lua_State* L = luaL_newstate();
+        if (!L)
+        {
+            LuaLoaderUtil::fail(error, "Not enough memory for a new state");
+            return nullptr;
+        }
+        luaL_openlibs(L);
+        LuaValBase::registerMetatables(L);
+        if (!apply(L, error))
+        {
+            lua_close(L);
+            return nullptr;
+        }
+        return L;
+    }
+
+    // Creates count states in parallel on LuaValThreadPool.
+    // Returns an empty list and sets error if any of them fails, the others are closed.
+    std::vector<lua_State*> newStates(size_t count, std::string* error = nullptr) const
+    {
+        std::vector<lua_State*> states(count, nullptr);
+        std::vector<std::string> errors(count);
+        LuaValThreadPool::instance().parallelFor(count, [&](size_t i) {
+            states[i] = newState(&errors[i]);
+        });
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (states[i])
+                continue;
+            for (lua_State* L : states)
+            {
+                if (L)
+                    lua_close(L);
+            }
+            LuaLoaderUtil::fail(error, errors[i]);
+            return std::vector<lua_State*>();
+        }
+        return states;
+    }
+
+    const std::vector<Chunk>& scriptChunks() const
+    {
+        return scripts;
+    }
+
+    const std::vector<Chunk>& moduleChunks() const
+    {
+        return modules;
+    }
+
+    // Compiles code to bytecode in a scratch state, returns false and sets error if it does not compile
+    static bool dump(const std::string& code, const std::string& chunk_name, std::string& bytecode, std::string* error = nullptr)
+    {
+        lua_State* L = luaL_newstate();
+        if (!L)
+            return LuaLoaderUtil::fail(error, "Not enough memory for a scratch state");
+        bool compiled = dump(L, code, chunk_name, bytecode, error);
+        lua_close(L);
+        return compiled;
+    }
+
+    // Compiles code with the given scratch state, leaving its stack as it was
+    static bool dump(lua_State* L, const std::string& code, const std::string& chunk_name, std::string& bytecode, std::string* error = nullptr)
+    {
+        bool compiled = luaL_loadbuffer(L, code.data(), code.size(), chunk_name.c_str()) == 0;
+        if (compiled)
+            dump(L, bytecode);
+        else if (error)
+        {
+            *error = lua_tostring(L, -1);
+        }
+        lua_pop(L, 1);
+        return compiled;
+    }
+
+    // Dumps the lua function on top of L to bytecode, leaving it on the stack
+    static void dump(lua_State* L, std::string& bytecode)
+    {
+        bytecode.clear();
+        // sol's compat layer takes the strip argument on every version
+        lua_dump(L, &writeChunk, &bytecode, 0);
+    }
+
+private:
+    static int writeChunk(lua_State* L, const void* data, size_t size, void* chunk)
+    {
+        static_cast<std::string*>(chunk)->append(static_cast<const char*>(data), size);
+        return 0;
+    }
+
+    // Converts the value at 1 to the unique_ptr at 2, runs under lua_pcall
+    static int convertConfig(lua_State* L)
+    {
+        auto& value = *static_cast<std::unique_ptr<LuaValBase>*>(lua_touserdata(L, 2));
+        value = LuaValBase::AsLuaVal(L, 1, LOCK_STATUS::NOT_LOCKED);
+        return 0;
+    }
+
+    static bool compile(const std::string& code, const std::string& chunk_name, std::vector<Chunk>& chunks, std::string* error)
+    {
+        Chunk chunk{ chunk_name, std::string() };
+        if (!dump(code, chunk_name, chunk.bytecode, error))
+            return false;
+        chunks.push_back(std::move(chunk));
+        return true;
+    }
+
+    std::vector<Chunk> scripts;
+    std::vector<Chunk> modules;
+    std::vector<Config> configs;
+    std::vector<Setup> setups;
+};
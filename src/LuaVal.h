@@ -30,11 +30,22 @@
 
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <memory> // std::unique_ptr
 #include <mutex> // std::mutex, std::unique_lock
+#include <condition_variable>
 #include <shared_mutex> // std::shared_mutex, std::unique_lock
 #include <utility> // std::tuple
+#include <vector>
+#include <deque>
+#include <thread> // std::this_thread::yield
+#include <atomic>
+#include <chrono>
+#include <algorithm> // std::min
+#include <cmath> // std::ceil
+#include <functional> // std::function
+#include <type_traits> // std::is_same
 
 extern "C"
 {
@@ -43,9 +54,165 @@ extern "C"
 #include "lauxlib.h"
 };
 
-enum class LOCK_STATUS {
-    LOCKED,
-    NOT_LOCKED,
+#include "LuaValLock.h"
+#include "LuaValQueue.h"
+#include "LuaValThreadPool.h"
+#include "LuaValTimerWheel.h"
+
+// Yieldable variants of blocking operations.
+// An attempt pushes its results and returns their count, or returns BUSY without pushing anything.
+// In a coroutine marked with markAwaitable a busy operation yields LuaVal.WAITING and tries again when
+// resumed, so the thread can run other coroutines meanwhile. Elsewhere it blocks like the blocking variants,
+// other coroutines may be resumed by code that does not expect LuaVal.WAITING.
+// Lua 5.2+ retries from a continuation, 5.1 and LuaJIT wrap the attempt in a resumable lua function.
+class LuaValAwait
+{
+public:
+    typedef int (*Attempt)(lua_State* L);
+
+    static constexpr int BUSY = -1;
+    // Registry table with the awaitable coroutines as weak keys
+    static constexpr const char* AWAITABLE_KEY = "LuaVal Awaitable Coroutines";
+
+    // Value yielded by waiting coroutines, resume them later to try again
+    static void* waitToken()
+    {
+        static char token;
+        return &token;
+    }
+
+    // Marks the coroutine at index as resumed again by its owner until it stops yielding LuaVal.WAITING
+    static void markAwaitable(lua_State* L, int index)
+    {
+        if (index < 0 && index > LUA_REGISTRYINDEX)
+            index = lua_gettop(L) + index + 1;
+        lua_getfield(L, LUA_REGISTRYINDEX, AWAITABLE_KEY);
+        if (lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_newtable(L);
+            lua_pushstring(L, "k");
+            lua_setfield(L, -2, "__mode");
+            lua_setmetatable(L, -2);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, LUA_REGISTRYINDEX, AWAITABLE_KEY);
+        }
+        lua_pushvalue(L, index);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+
+    static bool canYield(lua_State* L)
+    {
+#if LUA_VERSION_NUM >= 503
+        if (!lua_isyieldable(L))
+            return false;
+#endif
+        lua_getfield(L, LUA_REGISTRYINDEX, AWAITABLE_KEY);
+        if (lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            return false;
+        }
+        lua_pushthread(L);
+        lua_rawget(L, -2);
+        bool awaitable = lua_toboolean(L, -1) != 0;
+        lua_pop(L, 2);
+        return awaitable;
+    }
+
+    template<Attempt attempt>
+    static int block(lua_State* L)
+    {
+        int results = BUSY;
+        LuaValLockWait::poll([&] { results = attempt(L); return results != BUSY; });
+        return results;
+    }
+
+    template<Attempt attempt>
+    static int await(lua_State* L)
+    {
+        int results = attempt(L);
+        if (results != BUSY)
+            return results;
+        if (!canYield(L))
+            return block<attempt>(L);
+#if LUA_VERSION_NUM >= 502
+        int args = lua_gettop(L);
+        lua_pushlightuserdata(L, waitToken());
+        return lua_yieldk(L, 1, args, Continuation<attempt>::resume);
+#else
+        // The wrapper from pushFunction yields and calls again with the arguments following the token
+        int args = lua_gettop(L);
+        lua_pushlightuserdata(L, waitToken());
+        lua_insert(L, 1);
+        return args + 1;
+#endif
+    }
+
+    // Pushes a lua function running attempt until it succeeds
+    template<Attempt attempt>
+    static void pushFunction(lua_State* L)
+    {
+#if LUA_VERSION_NUM >= 502
+        lua_pushcclosure(L, &await<attempt>, 0);
+#else
+        static const char wrapper[] =
+            "local try, token, yield = ...\n"
+            "local function retry(first, ...)\n"
+            "    if first ~= token then return first, ... end\n"
+            "    yield(token)\n"
+            "    return retry(try(...))\n"
+            "end\n"
+            "return function(...) return retry(try(...)) end\n";
+        lua_getglobal(L, "coroutine");
+        if (lua_istable(L, -1))
+            lua_getfield(L, -1, "yield");
+        else
+            lua_pushnil(L);
+        lua_remove(L, -2);
+        if (!lua_isfunction(L, -1))
+        {
+            // Without the coroutine library nothing can yield
+            lua_pop(L, 1);
+            lua_pushcclosure(L, &block<attempt>, 0);
+            return;
+        }
+        if (luaL_loadbuffer(L, wrapper, sizeof(wrapper) - 1, "=LuaVal await") != 0)
+            lua_error(L);
+        lua_insert(L, -2);
+        lua_pushcclosure(L, &await<attempt>, 0);
+        lua_insert(L, -2);
+        lua_pushlightuserdata(L, waitToken());
+        lua_insert(L, -2);
+        lua_call(L, 3, 1);
+#endif
+    }
+
+private:
+#if LUA_VERSION_NUM >= 502
+    // The continuation is named through a class so sol's compat layer can append _52 to it, see LUA_KFUNCTION
+    template<Attempt attempt>
+    struct Continuation {
+        static int resume(lua_State* L, int status, lua_KContext args)
+        {
+            // Drop the values passed to resume
+            lua_settop(L, static_cast<int>(args));
+            return await<attempt>(L);
+        }
+
+#if LUA_VERSION_NUM == 502
+        static int resume_52(lua_State* L)
+        {
+            lua_KContext args = 0;
+            int status = lua_getctx(L, &args);
+            return resume(L, status, args);
+        }
+#endif
+    };
+#endif
 };
 
 class LuaValBase
@@ -56,8 +223,10 @@ public:
             return a->lessThan(*b);
         }
     };
+    // Keys are held by unique_ptr in tables and by shared_ptr in double buffered frames
     struct MapEq {
-        bool operator()(const std::unique_ptr<LuaValBase>& a, const std::unique_ptr<LuaValBase>& b) const {
+        template<typename Pointer>
+        bool operator()(const Pointer& a, const Pointer& b) const {
             if (typeid(*a) != typeid(*b)) {
                 return false;
             }
@@ -65,17 +234,58 @@ public:
         }
     };
     struct MapHash {
-        std::size_t operator()(const std::unique_ptr<LuaValBase>& k) const {
+        template<typename Pointer>
+        std::size_t operator()(const Pointer& k) const {
             return k->LuaValHash();
         }
     };
-    typedef std::unordered_map<std::unique_ptr<LuaValBase>, std::unique_ptr<LuaValBase>, MapHash, MapEq> MapType;
+    struct MapEntry {
+        std::unique_ptr<LuaValBase> value;
+        // Table version at the time this entry was last written
+        uint64_t version;
+    };
+    typedef std::unordered_map<std::unique_ptr<LuaValBase>, MapEntry, MapHash, MapEq> MapType;
+
+    // Keys written since change tracking was enabled, indexed by the version of their last write.
+    // Each key appears once so listing the changes since a version is O(log n + changes).
+    struct ChangeLog {
+        uint64_t trackedSince;
+        std::unordered_map<std::unique_ptr<LuaValBase>, uint64_t, MapHash, MapEq> lastWrite;
+        std::map<uint64_t, LuaValBase*> byVersion;
+
+        ChangeLog(uint64_t version) : trackedSince(version), lastWrite(), byVersion() {
+        }
+
+        void record(const std::unique_ptr<LuaValBase>& key, uint64_t version) {
+            auto it = lastWrite.find(key);
+            if (it == lastWrite.end()) {
+                it = lastWrite.emplace(key->clone(), version).first;
+            }
+            else {
+                byVersion.erase(it->second);
+                it->second = version;
+            }
+            byVersion.emplace(version, it->first.get());
+        }
+    };
     typedef std::tuple<typename MapType::iterator, typename MapType::iterator> IteratorState;
-    typedef std::tuple<typename MapType::iterator, typename MapType::iterator, std::shared_lock<std::shared_mutex>> IteratorStateLocked;
+    // Releases the shared lock a locked table iterator holds on its table
+    struct SharedUnlock {
+        void operator()(LuaValBase* table) const {
+            table->unlockTable();
+        }
+    };
+    typedef std::unique_ptr<LuaValBase, SharedUnlock> SharedTableGuard;
+    typedef std::tuple<typename MapType::iterator, typename MapType::iterator, SharedTableGuard> IteratorStateLocked;
 
     static constexpr const char* LUAVAL_METATABLE_KEY = "LuaVal";
     static constexpr const char* LUAVAL_ITERATOR_METATABLE_KEY = "LuaVal Iterator Metatable";
     static constexpr const char* LUAVAL_LOCKED_ITERATOR_METATABLE_KEY = "Locked LuaVal Iterator Metatable";
+    static constexpr const char* LUAVAL_TRANSACTION_METATABLE_KEY = "LuaVal Transaction Metatable";
+    static constexpr const char* LUAVAL_CHANNEL_METATABLE_KEY = "LuaVal Channel Metatable";
+    static constexpr const char* LUAVAL_SUBSCRIPTION_METATABLE_KEY = "LuaVal Subscription Metatable";
+    static constexpr const char* LUAVAL_FUTURE_METATABLE_KEY = "LuaVal Future Metatable";
+    static constexpr const char* LUAVAL_ACTOR_METATABLE_KEY = "LuaVal Actor Metatable";
 
     virtual ~LuaValBase() {
         // Required by abstract base class
@@ -122,7 +332,41 @@ public:
     template<typename T>
     static T* checkLuaVal(lua_State* L, int index, const char* metatable)
     {
-        return *(T**)luaL_checkudata(L, index, metatable);
+        T* v = *(T**)luaL_checkudata(L, index, metatable);
+        if (!v)
+            luaL_argerror(L, index, "LuaVal has been moved");
+        if constexpr (std::is_same<T, LuaValBase>::value)
+            return v->resolve();
+        return v;
+    }
+
+    // Takes ownership of the value at index without copying it.
+    // A LuaVal userdata is emptied and can not be used after this, other lua values are converted.
+    static std::unique_ptr<LuaValBase> MoveLuaVal(lua_State* L, int index)
+    {
+        if (isLuaVal(L, index, LUAVAL_METATABLE_KEY))
+        {
+            LuaValBase** ptr = (LuaValBase**)lua_touserdata(L, index);
+            if (!*ptr)
+                luaL_argerror(L, index, "LuaVal has been moved");
+            std::unique_ptr<LuaValBase> v(*ptr);
+            *ptr = nullptr;
+            return v;
+        }
+        return AsLuaVal(L, index, LOCK_STATUS::NOT_LOCKED);
+    }
+
+    // Pushes a value taken with MoveLuaVal, tables are handed to lua without copying
+    static int pushOwned(lua_State* L, std::unique_ptr<LuaValBase> v)
+    {
+        if (!v)
+        {
+            lua_pushnil(L);
+            return 1;
+        }
+        if (v->isTable())
+            return pushLuaVal(L, v.release(), LUAVAL_METATABLE_KEY);
+        return v->asObject(L);
     }
 
     static std::unique_ptr<LuaValBase> AsLuaVal(lua_State* L, int index, LOCK_STATUS status);
@@ -133,6 +377,14 @@ public:
     virtual size_t LuaValHash() const = 0;
     virtual int asObject(lua_State* L) = 0;
     virtual std::unique_ptr<LuaValBase> clone() = 0;
+    // The value lua functions operate on, references to shared values return the shared value
+    virtual LuaValBase* resolve() {
+        return this;
+    }
+    // Copy of a table using the lock policy of status
+    virtual std::unique_ptr<LuaValBase> convertTo(LOCK_STATUS status) {
+        return clone();
+    }
     virtual int Get(lua_State* L, int self_index, int key_index) {
         return luaL_argerror(L, self_index, "Trying to use non table value as table");
     }
@@ -142,6 +394,72 @@ public:
     virtual int iterate(lua_State* L, int self_index) {
         return luaL_argerror(L, self_index, "Trying to use non table value as table");
     }
+    virtual int GetMany(lua_State* L, int self_index, int first_key_index) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    virtual int SetMany(lua_State* L, int self_index, int table_index) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    // Like Get and Set, but push false instead of blocking past the deadline
+    virtual int TryGet(lua_State* L, int self_index, int key_index, LuaValLockWait::Clock::time_point deadline) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    virtual int TrySet(lua_State* L, int self_index, int key_index, int val_index, LuaValLockWait::Clock::time_point deadline) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    virtual void setSpinCount(uint32_t spin_count) {
+    }
+    virtual int Version(lua_State* L, int self_index) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    virtual int Swap(lua_State* L, int self_index) {
+        return luaL_argerror(L, self_index, "Trying to swap a value that is not double buffered");
+    }
+    virtual int TrackChanges(lua_State* L, int self_index, bool enable) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    virtual int ChangesSince(lua_State* L, int self_index, uint64_t since) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    virtual int Subscribe(lua_State* L, int self_index, int filter_index) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    virtual int CombineWrites(lua_State* L, int self_index, int mode_index) {
+        return luaL_argerror(L, self_index, "Trying to use non table value as table");
+    }
+    // Applies writes buffered by write combining, giving up with BUSY past the deadline
+    virtual LOCK_RESULT flushWrites(LuaValLockWait::Clock::time_point deadline = LuaValLockWait::NO_DEADLINE) {
+        return LOCK_RESULT::ACQUIRED;
+    }
+
+    // Versioned entry access, implemented by tables.
+    // findEntry and writeEntry require the table to be locked with lockTable.
+    virtual bool isTable() const {
+        return false;
+    }
+    virtual LOCK_STATUS lockStatus() const {
+        return LOCK_STATUS::NOT_LOCKED;
+    }
+    // Locks the table following LuaValLockHierarchy, reentrant for the calling thread.
+    // Each ACQUIRED result must be paired with unlockTable.
+    // The lock of a table covers the tables nested in it, they are only reachable through it.
+    virtual LOCK_RESULT lockTable(bool exclusive, LuaValLockWait::Clock::time_point deadline = LuaValLockWait::NO_DEADLINE) {
+        return LOCK_RESULT::ACQUIRED;
+    }
+    virtual void unlockTable() {
+    }
+    virtual const MapEntry* findEntry(const std::unique_ptr<LuaValBase>& key) const {
+        return nullptr;
+    }
+    virtual void writeEntry(std::unique_ptr<LuaValBase> key, std::unique_ptr<LuaValBase> value) {
+    }
+    // Bucket access for bulk operations, requires the table to be locked.
+    // Distinct bucket ranges can be scanned from several threads at once.
+    virtual size_t bucketCount() const {
+        return 0;
+    }
+    virtual void scanBuckets(size_t first, size_t last, const std::function<void(const LuaValBase& key, const LuaValBase& value)>& visit) const {
+    }
 
     // Lua functions
 
@@ -158,9 +476,55 @@ public:
         return pushLuaVal(L, v.release(), LUAVAL_METATABLE_KEY);
     }
 
+    static LOCK_STATUS checkLockStatus(lua_State* L, int index, const char* def)
+    {
+        static const char* const names[] = { "shared", "spin", "reader", "fair", "none", nullptr };
+        static const LOCK_STATUS statuses[] = {
+            LOCK_STATUS::LOCKED,
+            LOCK_STATUS::SPIN_LOCKED,
+            LOCK_STATUS::READER_BIASED_LOCKED,
+            LOCK_STATUS::FAIR_LOCKED,
+            LOCK_STATUS::NOT_LOCKED,
+        };
+        return statuses[luaL_checkoption(L, index, def, names)];
+    }
+
+    static int lockError(lua_State* L, LOCK_RESULT result)
+    {
+        switch (result)
+        {
+        case LOCK_RESULT::UPGRADE:
+            return luaL_error(L, "Table is locked for reading by this thread and can not be written");
+        case LOCK_RESULT::ORDER:
+            return luaL_error(L, "Table lock is out of order with the tables this thread holds, lock them together with LuaVal.withLocks");
+        default:
+            return luaL_error(L, "Table is busy");
+        }
+    }
+
+    // Copies the LuaVal at index while holding its lock, converting it to status if convert is set
+    static std::unique_ptr<LuaValBase> copyLuaVal(lua_State* L, int index, bool convert, LOCK_STATUS status)
+    {
+        LuaValBase* lv = getLuaVal<LuaValBase>(L, index);
+        if (!lv)
+            luaL_argerror(L, index, "LuaVal has been moved");
+        lv = lv->resolve();
+        LOCK_RESULT result = lv->lockTable(false);
+        if (result != LOCK_RESULT::ACQUIRED)
+            lockError(L, result);
+        auto copy = convert ? lv->convertTo(status) : lv->clone();
+        lv->unlockTable();
+        return copy;
+    }
+
     static int factoryLocked(lua_State* L)
     {
-        std::unique_ptr<LuaValBase> v = AsLuaVal(L, 1, LOCK_STATUS::LOCKED);
+        LOCK_STATUS status = checkLockStatus(L, 2, "shared");
+        std::unique_ptr<LuaValBase> v;
+        if (isLuaVal(L, 1, LUAVAL_METATABLE_KEY))
+            v = copyLuaVal(L, 1, true, status);
+        else
+            v = AsLuaVal(L, 1, status);
         return pushLuaVal(L, v.release(), LUAVAL_METATABLE_KEY);
     }
 
@@ -186,74 +550,160 @@ public:
         return luaval->iterate(L, self_index);
     }
 
-    static int pushAsLua(lua_State* L)
-    {
-        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, 1, LUAVAL_METATABLE_KEY);
-        int depth = static_cast<int>(luaL_optinteger(L, 2, 0));
-        return luaval->pushAsLua(L, depth);
+    static int GetMany(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int first_key_index = 2;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        return luaval->GetMany(L, self_index, first_key_index);
     }
 
-    static void registerMetatables(lua_State* L)
-    {
-        if (luaL_newmetatable(L, LUAVAL_METATABLE_KEY) == 0)
+    static int SetMany(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int table_index = 2;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        luaL_checktype(L, table_index, LUA_TTABLE);
+        return luaval->SetMany(L, self_index, table_index);
+    }
+
+    static int TryGet(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int key_index = 2;
+        constexpr int timeout_index = 3;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        auto deadline = LuaValLockWait::deadlineAfter(luaL_optnumber(L, timeout_index, 0));
+        return luaval->TryGet(L, self_index, key_index, deadline);
+    }
+
+    static int TrySet(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int key_index = 2;
+        constexpr int val_index = 3;
+        constexpr int timeout_index = 4;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        auto deadline = LuaValLockWait::deadlineAfter(luaL_optnumber(L, timeout_index, 0));
+        return luaval->TrySet(L, self_index, key_index, val_index, deadline);
+    }
+
+    // Attempts of LuaVal.awaitGet(lv, key) and LuaVal.awaitSet(lv, key, value), see LuaValAwait
+    static int AttemptGet(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int key_index = 2;
+        lua_settop(L, key_index);
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        int results = luaval->TryGet(L, self_index, key_index, LuaValLockWait::Clock::now());
+        if (!lua_toboolean(L, -results))
         {
-            lua_pop(L, 1);
-            luaL_error(L, "Metatable %s already registered", LUAVAL_METATABLE_KEY);
-            return;
+            lua_pop(L, results);
+            return LuaValAwait::BUSY;
         }
-        lua_pushstring(L, "__gc");
-        lua_pushcclosure(L, &gc_closure<LuaValBase>, 0);
-        lua_rawset(L, -3);
+        lua_remove(L, -results);
+        return results - 1;
+    }
 
-        lua_pushstring(L, "asLua");
-        lua_pushcclosure(L, &pushAsLua, 0);
-        lua_rawset(L, -3);
+    static int AttemptSet(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int key_index = 2;
+        constexpr int val_index = 3;
+        lua_settop(L, val_index);
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        int results = luaval->TrySet(L, self_index, key_index, val_index, LuaValLockWait::Clock::now());
+        bool written = lua_toboolean(L, -results);
+        lua_pop(L, results);
+        return written ? 0 : LuaValAwait::BUSY;
+    }
 
-        lua_pushstring(L, "new");
-        lua_pushcclosure(L, &factory, 0);
-        lua_rawset(L, -3);
+    static int SetSpinCount(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int spin_index = 2;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        lua_Integer spin_count = luaL_checkinteger(L, spin_index);
+        luaL_argcheck(L, spin_count >= 0 && spin_count <= UINT32_MAX, spin_index, "Spin count out of range");
+        luaval->setSpinCount(static_cast<uint32_t>(spin_count));
+        return 0;
+    }
 
-        lua_pushstring(L, "newLocked");
-        lua_pushcclosure(L, &factoryLocked, 0);
-        lua_rawset(L, -3);
+    static int Version(lua_State* L) {
+        constexpr int self_index = 1;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        return luaval->Version(L, self_index);
+    }
 
-        lua_pushstring(L, "iterate");
-        lua_pushcclosure(L, &iterate, 0);
-        lua_rawset(L, -3);
+    static int TrackChanges(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int enable_index = 2;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        bool enable = lua_isnoneornil(L, enable_index) || lua_toboolean(L, enable_index);
+        return luaval->TrackChanges(L, self_index, enable);
+    }
 
-        lua_pushstring(L, "__index");
-        lua_pushcclosure(L, &Get, 0);
-        lua_rawset(L, -3);
+    static int ChangesSince(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int version_index = 2;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        lua_Number since = luaL_checknumber(L, version_index);
+        luaL_argcheck(L, since >= 0, version_index, "Version must not be negative");
+        return luaval->ChangesSince(L, self_index, static_cast<uint64_t>(since));
+    }
 
-        lua_pushstring(L, "__newindex");
-        lua_pushcclosure(L, &Set, 0);
-        lua_rawset(L, -3);
+    static int Subscribe(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int filter_index = 2;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        return luaval->Subscribe(L, self_index, filter_index);
+    }
 
-        // Set LuaVal as a global variable
-        lua_setglobal(L, LUAVAL_METATABLE_KEY); // lua_pop(L, 1);
+    typedef std::vector<std::pair<std::unique_ptr<LuaValBase>, std::unique_ptr<LuaValBase>>> EntryBatch;
 
-        if (luaL_newmetatable(L, LUAVAL_ITERATOR_METATABLE_KEY) == 0)
+    // Converts all key value pairs of the lua table at index
+    static EntryBatch AsEntryBatch(lua_State* L, int index, LOCK_STATUS status)
+    {
+        EntryBatch batch;
+        int real_index = index > 0 || index <= LUA_REGISTRYINDEX ? index : lua_gettop(L) + index + 1;
+        lua_pushnil(L);
+        while (lua_next(L, real_index))
         {
+            auto key = AsLuaVal(L, -2, status);
+            auto value = AsLuaVal(L, -1, status);
+            if (key && value)
+                batch.emplace_back(std::move(key), std::move(value));
             lua_pop(L, 1);
-            luaL_error(L, "Metatable %s already registered", LUAVAL_ITERATOR_METATABLE_KEY);
-            return;
         }
-        lua_pushstring(L, "__gc");
-        lua_pushcclosure(L, &gc_closure<IteratorState>, 0);
-        lua_rawset(L, -3);
-        lua_pop(L, 1);
+        return batch;
+    }
 
-        if (luaL_newmetatable(L, LUAVAL_LOCKED_ITERATOR_METATABLE_KEY) == 0)
-        {
-            lua_pop(L, 1);
-            luaL_error(L, "Metatable %s already registered", LUAVAL_LOCKED_ITERATOR_METATABLE_KEY);
-            return;
-        }
-        lua_pushstring(L, "__gc");
-        lua_pushcclosure(L, &gc_closure<IteratorStateLocked>, 0);
-        lua_rawset(L, -3);
-        lua_pop(L, 1);
+    static int pushAsLua(lua_State* L)
+    {
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, 1, LUAVAL_METATABLE_KEY);
+        int depth = static_cast<int>(luaL_optinteger(L, 2, 0));
+        LOCK_RESULT result = luaval->lockTable(false);
+        if (result != LOCK_RESULT::ACQUIRED)
+            return lockError(L, result);
+        int n = luaval->pushAsLua(L, depth);
+        luaval->unlockTable();
+        return n;
+    }
+
+    static int Swap(lua_State* L) {
+        constexpr int self_index = 1;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        return luaval->Swap(L, self_index);
+    }
+
+    static int CombineWrites(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int mode_index = 2;
+        LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+        return luaval->CombineWrites(L, self_index, mode_index);
     }
+
+    // Flushes the buffered writes of one table, or of every table with write combining if no table is given
+    static int Flush(lua_State* L);
+
+    static int transaction(lua_State* L);
+
+    static int withLocks(lua_State* L);
+
+    static void registerMetatables(lua_State* L);
 };
 
 template<typename T>
@@ -265,6 +715,11 @@ public:
 
     LuaVal(const T& v) : v(v) {}
 
+    const T& get() const
+    {
+        return v;
+    }
+
     size_t LuaValHash() const override
     {
         return std::hash<decltype(v)>{}(v);
@@ -316,171 +771,337 @@ template class LuaVal<double>;
 template class LuaVal<bool>;
 template class LuaVal<std::string>;
 
-class LuaValTable;
-class LuaValTableLocked;
-
-class LuaValTable : public LuaValBase
+// Write combining buffers of a table.
+// While enabled, sets are buffered in a slot picked by the writing thread instead of locking the table,
+// and the buffered writes are applied in one batch under a single exclusive lock when the table is flushed.
+// Buffered writes are not visible to readers before the flush.
+class LuaValWriteCombiner
 {
-protected:
-    MapType v;
 public:
-    LuaValTable() : LuaValBase(), v() {
+    enum class MERGE {
+        OFF,
+        LAST, // last buffered write of a key wins, slots are applied in slot order
+        SUM, // buffered numbers are added to the value of the key
+    };
+    struct Pending {
+        std::unique_ptr<LuaValBase> value;
+        bool sum;
+    };
+    typedef std::unordered_map<std::unique_ptr<LuaValBase>, Pending, LuaValBase::MapHash, LuaValBase::MapEq> Buffer;
+
+    static constexpr size_t SLOTS = 16;
+
+    LuaValWriteCombiner() : mode(MERGE::OFF) {
     }
-    LuaValTable(LuaValTable& lv) : LuaValBase(), v() {
-        for (auto& it : lv.v)
-        {
-            v[it.first->clone()] = it.second->clone();
-        }
+
+    MERGE getMode() const {
+        return mode.load(std::memory_order_acquire);
     }
-    friend class LuaValTableLocked;
-    LuaValTable(LuaValTableLocked& lv);
 
-    int Get(lua_State* L, int self_index, int key_index) override {
-        auto klv = AsLuaVal(L, key_index, LOCK_STATUS::NOT_LOCKED);
-        if (!klv)
-            return luaL_argerror(L, key_index, "Table key is nil");
-        auto it = v.find(klv);
-        if (it == v.end())
-        {
-            lua_pushnil(L);
-            return 1;
-        }
-        else
-        {
-            auto& val = it->second;
-            return val->asObject(L);
-        }
+    // Changing the mode must be followed by a flush so writes buffered under the old mode are applied
+    void setMode(MERGE merge) {
+        mode.store(merge, std::memory_order_release);
     }
 
-    int Set(lua_State* L, int self_index, int key_index, int val_index) override {
-        auto kk = AsLuaVal(L, key_index, LOCK_STATUS::NOT_LOCKED);
-        auto vv = AsLuaVal(L, val_index, LOCK_STATUS::NOT_LOCKED);
-        if (!kk)
-            return luaL_argerror(L, key_index, "Table key is nil");
-        if (!vv)
-            v.erase(kk);
+    static bool isNumber(const std::unique_ptr<LuaValBase>& value) {
+        return value && typeid(*value) == typeid(LuaVal<double>);
+    }
+
+    static double number(const std::unique_ptr<LuaValBase>& value) {
+        return static_cast<const LuaVal<double>&>(*value).get();
+    }
+
+    // Buffers a write and returns true, or returns false without taking the key and value
+    // if combining is off or a summing write has no number value.
+    bool add(std::unique_ptr<LuaValBase>& key, std::unique_ptr<LuaValBase>& value) {
+        auto& slot = slots[LuaValThreadIndex() % SLOTS];
+        std::lock_guard guard(slot.mutex);
+        // Checked under the slot mutex so a flush after turning combining off sees every buffered write
+        MERGE merge = mode.load(std::memory_order_acquire);
+        if (merge == MERGE::OFF || (merge == MERGE::SUM && !isNumber(value)))
+            return false;
+        auto it = slot.writes.find(key);
+        if (it == slot.writes.end())
+            slot.writes.emplace(std::move(key), Pending{ std::move(value), merge == MERGE::SUM });
+        else if (merge == MERGE::SUM && it->second.sum)
+            it->second.value = std::make_unique<LuaVal<double>>(number(it->second.value) + number(value));
         else
-            v.insert_or_assign(std::move(kk), std::move(vv));
-        return 0;
+            it->second = Pending{ std::move(value), merge == MERGE::SUM };
+        return true;
     }
 
-    static int iterate_closure(lua_State* L)
-    {
-        if (!isLuaVal(L, 1, LUAVAL_ITERATOR_METATABLE_KEY)) {
-            return luaL_argerror(L, 1, "Trying to iterate using invalid iterator object");
+    // Moves the buffered writes of every slot to out
+    void drain(std::vector<Buffer>& out) {
+        for (auto& slot : slots) {
+            std::lock_guard guard(slot.mutex);
+            if (slot.writes.empty())
+                continue;
+            out.push_back(std::move(slot.writes));
+            slot.writes = Buffer();
         }
-        auto state_tuple = getLuaVal<IteratorState>(L, 1);
-        if (std::get<0>(*state_tuple) == std::get<1>(*state_tuple))
+    }
+
+    // Tables with combining enabled are flushed together by flushAll at the end of a tick
+    void registerTable(LuaValBase* table) {
+        registration = std::make_shared<Registration>();
+        registration->table = table;
+        std::lock_guard guard(registryMutex());
+        registry().insert(registration);
+    }
+    // Called by the table before it is destroyed, waits for a flushAll flushing it right now
+    void unregisterTable() {
+        if (!registration)
+            return;
         {
-            // iteration ended
-            return 0;
+            std::lock_guard guard(registration->mutex);
+            registration->table = nullptr;
         }
-        auto oldit = std::get<0>(*state_tuple)++;
-        return oldit->first->asObject(L) + oldit->second->asObject(L);
+        std::lock_guard guard(registryMutex());
+        registry().erase(registration);
     }
+    static void flushAll();
 
-    int iterate(lua_State* L, int self_index) override
-    {
-        lua_pushcfunction(L, &iterate_closure);
-        return 1 + pushLuaVal(L, new IteratorState(v.begin(), v.end()), LUAVAL_ITERATOR_METATABLE_KEY);
-    }
+private:
+    struct alignas(64) Slot {
+        std::mutex mutex;
+        Buffer writes;
+    };
 
-    int pushAsLua(lua_State* L, uint32_t depth) override
+    // Outlives the table for a flushAll that copied the registry before the table was destroyed
+    struct Registration {
+        std::mutex mutex;
+        LuaValBase* table = nullptr;
+    };
+
+    static std::mutex& registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static std::unordered_set<std::shared_ptr<Registration>>& registry() {
+        static std::unordered_set<std::shared_ptr<Registration>> tables;
+        return tables;
+    }
+
+    std::atomic<MERGE> mode;
+    Slot slots[SLOTS];
+    std::shared_ptr<Registration> registration;
+};
+
+// Change events of a table collected for a subscriber.
+// Writers append events while holding the table lock, the subscriber drains them in batches.
+// A string filter matches string keys starting with it, other filters match one key.
+class LuaValSubscription
+{
+public:
+    struct Event {
+        std::unique_ptr<LuaValBase> key;
+        std::unique_ptr<LuaValBase> oldValue;
+        std::unique_ptr<LuaValBase> newValue;
+    };
+
+    // Owned by the lua userdata, closing the subscription when collected
+    struct Handle {
+        std::shared_ptr<LuaValSubscription> subscription;
+        ~Handle() {
+            subscription->close();
+        }
+    };
+
+    LuaValSubscription(std::unique_ptr<LuaValBase> filter) : filter(std::move(filter)), prefix(nullptr), mutex(), events(), closed(false) {
+        if (this->filter && typeid(*this->filter) == typeid(LuaVal<std::string>))
+            prefix = &static_cast<const LuaVal<std::string>&>(*this->filter).get();
+    }
+
+    bool matches(const LuaValBase& key) const {
+        if (!filter)
+            return true;
+        if (prefix) {
+            if (typeid(key) != typeid(LuaVal<std::string>))
+                return false;
+            return static_cast<const LuaVal<std::string>&>(key).get().compare(0, prefix->size(), *prefix) == 0;
+        }
+        return typeid(key) == typeid(*filter) && filter->equalTo(key);
+    }
+
+    void push(Event event) {
+        std::lock_guard<std::mutex> guard(mutex);
+        events.push_back(std::move(event));
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+    }
+
+    bool isClosed() const {
+        return closed.load(std::memory_order_acquire);
+    }
+
+    // Lua functions
+
+    // sub:drain([max]) returns a list of { key = k, old = v, new = v } tables in write order
+    static int Drain(lua_State* L)
     {
-        lua_newtable(L);
-        for (auto& it : v) {
-            if (depth == 1)
-            {
-                it.first->asObject(L);
-                it.second->asObject(L);
-                lua_rawset(L, -3);
-            }
-            if (depth == 0)
-            {
-                it.first->pushAsLua(L, depth);
-                it.second->pushAsLua(L, depth);
-                lua_rawset(L, -3);
+        constexpr int self_index = 1;
+        constexpr int max_index = 2;
+        auto subscription = LuaValBase::checkLuaVal<Handle>(L, self_index, LuaValBase::LUAVAL_SUBSCRIPTION_METATABLE_KEY)->subscription;
+        lua_Integer max = luaL_optinteger(L, max_index, 0);
+        std::vector<Event> batch;
+        {
+            std::lock_guard<std::mutex> guard(subscription->mutex);
+            if (max <= 0 || static_cast<size_t>(max) >= subscription->events.size()) {
+                batch.swap(subscription->events);
             }
-            else
-            {
-                it.first->pushAsLua(L, depth - 1);
-                it.second->pushAsLua(L, depth - 1);
-                lua_rawset(L, -3);
+            else {
+                auto end = subscription->events.begin() + static_cast<ptrdiff_t>(max);
+                batch.assign(std::make_move_iterator(subscription->events.begin()), std::make_move_iterator(end));
+                subscription->events.erase(subscription->events.begin(), end);
             }
         }
+        lua_createtable(L, static_cast<int>(batch.size()), 0);
+        int i = 0;
+        for (auto& event : batch) {
+            lua_createtable(L, 0, 3);
+            lua_pushstring(L, "key");
+            LuaValBase::pushOwned(L, std::move(event.key));
+            lua_rawset(L, -3);
+            lua_pushstring(L, "old");
+            LuaValBase::pushOwned(L, std::move(event.oldValue));
+            lua_rawset(L, -3);
+            lua_pushstring(L, "new");
+            LuaValBase::pushOwned(L, std::move(event.newValue));
+            lua_rawset(L, -3);
+            lua_rawseti(L, -2, ++i);
+        }
         return 1;
     }
 
-    int asObject(lua_State* L) override
+    static int Pending(lua_State* L)
     {
-        return pushLuaVal(L, new LuaValTable(*this), LUAVAL_METATABLE_KEY);
+        auto& subscription = LuaValBase::checkLuaVal<Handle>(L, 1, LuaValBase::LUAVAL_SUBSCRIPTION_METATABLE_KEY)->subscription;
+        std::lock_guard<std::mutex> guard(subscription->mutex);
+        lua_pushnumber(L, static_cast<lua_Number>(subscription->events.size()));
+        return 1;
     }
 
-    size_t LuaValHash() const override
+    static int Close(lua_State* L)
     {
-        return std::hash<decltype(this)>{}(this);
+        LuaValBase::checkLuaVal<Handle>(L, 1, LuaValBase::LUAVAL_SUBSCRIPTION_METATABLE_KEY)->subscription->close();
+        return 0;
     }
 
-    void FromTable(lua_State* L, int index)
-    {
-        int real_idex = abs_index(L, index);
-        lua_pushnil(L);
-        while (lua_next(L, real_idex))
-        {
-            auto key = AsLuaVal(L, -2, LOCK_STATUS::NOT_LOCKED);
-            auto value = AsLuaVal(L, -1, LOCK_STATUS::NOT_LOCKED);
-            // skip nil keys and values
-            if (key && value)
-                v.emplace(std::move(key), std::move(value));
-            lua_pop(L, 1);
+private:
+    std::unique_ptr<LuaValBase> filter;
+    const std::string* prefix;
+    std::mutex mutex;
+    std::vector<Event> events;
+    std::atomic<bool> closed;
+};
+
+// Table parameterized on the lock policy protecting it, see LuaValLock.h
+template<typename LockPolicy>
+class LuaValTableT : public LuaValBase
+{
+protected:
+    static constexpr bool IS_LOCKED = LockPolicy::STATUS != LOCK_STATUS::NOT_LOCKED;
+
+    MapType v;
+    // Incremented on every write, readable without locking
+    std::atomic<uint64_t> version;
+    LockPolicy lock;
+    std::atomic<uint32_t> spinCount;
+    // Only allocated while change tracking is enabled
+    std::unique_ptr<ChangeLog> changes;
+    std::vector<std::shared_ptr<LuaValSubscription>> subscribers;
+    // Only allocated once write combining is first enabled and kept until the table is destroyed,
+    // since writers use it without holding the table lock
+    std::atomic<LuaValWriteCombiner*> combiner;
+
+    // Called with the exclusive lock held before key is written
+    void notifySubscribers(const std::unique_ptr<LuaValBase>& key, const std::unique_ptr<LuaValBase>& value) {
+        auto it = v.find(key);
+        LuaValBase* old_value = it == v.end() ? nullptr : it->second.value.get();
+        if (!old_value && !value)
+            return;
+        for (auto& subscription : subscribers) {
+            if (subscription->isClosed() || !subscription->matches(*key))
+                continue;
+            subscription->push(LuaValSubscription::Event{
+                key->clone(),
+                old_value ? old_value->clone() : nullptr,
+                value ? value->clone() : nullptr,
+            });
         }
+        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(), [](const std::shared_ptr<LuaValSubscription>& subscription) {
+            return subscription->isClosed();
+        }), subscribers.end());
     }
 
-    bool lessThan(const LuaValBase& other) const override {
-        if (typeid(*this) != typeid(other)) {
+    template<typename Guard>
+    bool acquire(Guard& guard, LuaValLockWait::Clock::time_point deadline = LuaValLockWait::NO_DEADLINE) {
+        if constexpr (!IS_LOCKED) {
+            guard.lock();
             return true;
         }
-        return &v < &static_cast<const LuaValTable&>(other).v;
-    }
-    bool equalTo(const LuaValBase& other) const override {
-        if (typeid(*this) != typeid(other)) {
-            return false;
+        else {
+            return LuaValLockWait::acquire(guard, spinCount.load(std::memory_order_relaxed), deadline);
         }
-        return &v == &static_cast<const LuaValTable&>(other).v;
     }
 
-    std::unique_ptr<LuaValBase> clone() override {
-        auto c = std::make_unique<LuaValTable>();
-        for (const auto& k_v : v) {
-            c->v[k_v.first->clone()] = k_v.second->clone();
+    // Lock taken with lockTable for the scope
+    class ScopedLock
+    {
+    public:
+        ScopedLock(LuaValTableT& table, bool exclusive, LuaValLockWait::Clock::time_point deadline = LuaValLockWait::NO_DEADLINE) :
+            table(table), result(table.LuaValTableT::lockTable(exclusive, deadline)) {
         }
-        return c;
-    }
-};
+        ~ScopedLock() {
+            if (result == LOCK_RESULT::ACQUIRED)
+                table.LuaValTableT::unlockTable();
+        }
+        ScopedLock(const ScopedLock&) = delete;
+        ScopedLock& operator=(const ScopedLock&) = delete;
 
-class LuaValTableLocked : public LuaValBase
-{
-protected:
-    MapType v;
-    std::shared_mutex lock;
-public:
-    LuaValTableLocked() : LuaValBase(), v() {
-    }
-    LuaValTableLocked(LuaValTableLocked& lv) : LuaValBase(), v() {
-        std::shared_lock guard(lv.lock);
+        LuaValTableT& table;
+        const LOCK_RESULT result;
+    };
+
+    // The caller holds the lock of the table lv is nested in, or of lv itself if it is not nested
+    template<typename OtherPolicy>
+    void copyFrom(LuaValTableT<OtherPolicy>& lv) {
+        version.store(lv.version.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        v.reserve(lv.v.size());
         for (auto& it : lv.v)
         {
-            v[it.first->clone()] = it.second->clone();
+            v.emplace(it.first->clone(), MapEntry{ it.second.value->clone(), it.second.version });
+        }
+    }
+public:
+    template<typename OtherPolicy>
+    friend class LuaValTableT;
+
+    LuaValTableT() : LuaValBase(), v(), version(0), spinCount(0), changes(), subscribers(), combiner(nullptr) {
+    }
+    LuaValTableT(LuaValTableT& lv) : LuaValBase(), v(), version(0), spinCount(lv.spinCount.load(std::memory_order_relaxed)), changes(), subscribers(), combiner(nullptr) {
+        copyFrom(lv);
+    }
+    template<typename OtherPolicy>
+    LuaValTableT(LuaValTableT<OtherPolicy>& lv) : LuaValBase(), v(), version(0), spinCount(0), changes(), subscribers(), combiner(nullptr) {
+        copyFrom(lv);
+    }
+    ~LuaValTableT() {
+        if (LuaValWriteCombiner* buffers = combiner.load(std::memory_order_acquire)) {
+            buffers->unregisterTable();
+            delete buffers;
         }
     }
-    friend class LuaValTable;
-    LuaValTableLocked(LuaValTable& lv);
 
     int Get(lua_State* L, int self_index, int key_index) override {
-        auto klv = AsLuaVal(L, key_index, LOCK_STATUS::LOCKED);
+        auto klv = AsLuaVal(L, key_index, LockPolicy::STATUS);
         if (!klv)
             return luaL_argerror(L, key_index, "Table key is nil");
-        std::shared_lock guard(lock);
+        ScopedLock guard(*this, false);
+        if (guard.result != LOCK_RESULT::ACQUIRED)
+            return lockError(L, guard.result);
         auto it = v.find(klv);
         if (it == v.end())
         {
@@ -489,24 +1110,335 @@ public:
         }
         else
         {
-            auto& val = it->second;
+            auto& val = it->second.value;
             return val->asObject(L);
         }
     }
 
     int Set(lua_State* L, int self_index, int key_index, int val_index) override {
-        auto kk = AsLuaVal(L, key_index, LOCK_STATUS::LOCKED);
-        auto vv = AsLuaVal(L, val_index, LOCK_STATUS::LOCKED);
+        auto kk = AsLuaVal(L, key_index, LockPolicy::STATUS);
+        auto vv = AsLuaVal(L, val_index, LockPolicy::STATUS);
         if (!kk)
             return luaL_argerror(L, key_index, "Table key is nil");
-        std::unique_lock guard(lock);
-        if (!vv)
-            v.erase(std::move(kk));
-        else
-            v.insert_or_assign(std::move(kk), std::move(vv));
+        if (LuaValWriteCombiner* buffers = combiner.load(std::memory_order_acquire)) {
+            if (buffers->getMode() == LuaValWriteCombiner::MERGE::SUM && !LuaValWriteCombiner::isNumber(vv))
+                return luaL_argerror(L, val_index, "Summing write combining needs number values");
+            if (buffers->add(kk, vv))
+                return 0;
+        }
+        ScopedLock guard(*this, true);
+        if (guard.result != LOCK_RESULT::ACQUIRED)
+            return lockError(L, guard.result);
+        writeEntry(std::move(kk), std::move(vv));
+        return 0;
+    }
+
+    int GetMany(lua_State* L, int self_index, int first_key_index) override {
+        int top = lua_gettop(L);
+        luaL_checkstack(L, top - first_key_index + 1, "Too many keys");
+        if constexpr (!IS_LOCKED) {
+            for (int key_index = first_key_index; key_index <= top; ++key_index) {
+                auto klv = AsLuaVal(L, key_index, LockPolicy::STATUS);
+                if (!klv)
+                    return luaL_argerror(L, key_index, "Table key is nil");
+                auto it = v.find(klv);
+                if (it == v.end())
+                    lua_pushnil(L);
+                else
+                    it->second.value->asObject(L);
+            }
+            return top - first_key_index + 1;
+        }
+        else {
+            // Convert keys before locking so the lock is held only for the lookups
+            std::vector<std::unique_ptr<LuaValBase>> keys;
+            keys.reserve(top - first_key_index + 1);
+            for (int key_index = first_key_index; key_index <= top; ++key_index) {
+                if (lua_isnoneornil(L, key_index))
+                    return luaL_argerror(L, key_index, "Table key is nil");
+                keys.push_back(AsLuaVal(L, key_index, LockPolicy::STATUS));
+            }
+            ScopedLock guard(*this, false);
+            if (guard.result != LOCK_RESULT::ACQUIRED)
+                return lockError(L, guard.result);
+            for (auto& klv : keys) {
+                auto it = v.find(klv);
+                if (it == v.end())
+                    lua_pushnil(L);
+                else
+                    it->second.value->asObject(L);
+            }
+            return static_cast<int>(keys.size());
+        }
+    }
+
+    int SetMany(lua_State* L, int self_index, int table_index) override {
+        auto batch = AsEntryBatch(L, table_index, LockPolicy::STATUS);
+        ScopedLock guard(*this, true);
+        if (guard.result != LOCK_RESULT::ACQUIRED)
+            return lockError(L, guard.result);
+        v.reserve(v.size() + batch.size());
+        for (auto& it : batch)
+            writeEntry(std::move(it.first), std::move(it.second));
+        return 0;
+    }
+
+    int TryGet(lua_State* L, int self_index, int key_index, LuaValLockWait::Clock::time_point deadline) override {
+        auto klv = AsLuaVal(L, key_index, LockPolicy::STATUS);
+        if (!klv)
+            return luaL_argerror(L, key_index, "Table key is nil");
+        ScopedLock guard(*this, false, deadline);
+        if (guard.result == LOCK_RESULT::BUSY)
+        {
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+        if (guard.result != LOCK_RESULT::ACQUIRED)
+            return lockError(L, guard.result);
+        lua_pushboolean(L, 1);
+        auto it = v.find(klv);
+        if (it == v.end())
+        {
+            lua_pushnil(L);
+            return 2;
+        }
+        return 1 + it->second.value->asObject(L);
+    }
+
+    int TrySet(lua_State* L, int self_index, int key_index, int val_index, LuaValLockWait::Clock::time_point deadline) override {
+        auto kk = AsLuaVal(L, key_index, LockPolicy::STATUS);
+        auto vv = AsLuaVal(L, val_index, LockPolicy::STATUS);
+        if (!kk)
+            return luaL_argerror(L, key_index, "Table key is nil");
+        ScopedLock guard(*this, true, deadline);
+        if (guard.result != LOCK_RESULT::ACQUIRED && guard.result != LOCK_RESULT::BUSY)
+            return lockError(L, guard.result);
+        bool acquired = guard.result == LOCK_RESULT::ACQUIRED;
+        if (acquired)
+            writeEntry(std::move(kk), std::move(vv));
+        lua_pushboolean(L, acquired);
+        return 1;
+    }
+
+    int CombineWrites(lua_State* L, int self_index, int mode_index) override {
+        static const char* const modes[] = { "off", "last", "sum", nullptr };
+        auto merge = static_cast<LuaValWriteCombiner::MERGE>(luaL_checkoption(L, mode_index, "last", modes));
+        LuaValWriteCombiner* buffers = combiner.load(std::memory_order_acquire);
+        if (!buffers && merge == LuaValWriteCombiner::MERGE::OFF)
+            return 0;
+        bool created = false;
+        if (!buffers) {
+            ScopedLock guard(*this, true);
+            if (guard.result != LOCK_RESULT::ACQUIRED)
+                return lockError(L, guard.result);
+            buffers = combiner.load(std::memory_order_relaxed);
+            if (!buffers) {
+                buffers = new LuaValWriteCombiner();
+                combiner.store(buffers, std::memory_order_release);
+                created = true;
+            }
+        }
+        if (created)
+            buffers->registerTable(this);
+        buffers->setMode(merge);
+        // Writes buffered before combining was turned off would otherwise wait for the next flush
+        if (merge == LuaValWriteCombiner::MERGE::OFF) {
+            LOCK_RESULT result = flushWrites();
+            if (result != LOCK_RESULT::ACQUIRED)
+                return lockError(L, result);
+        }
+        return 0;
+    }
+
+    LOCK_RESULT flushWrites(LuaValLockWait::Clock::time_point deadline = LuaValLockWait::NO_DEADLINE) override {
+        LuaValWriteCombiner* buffers = combiner.load(std::memory_order_acquire);
+        if (!buffers)
+            return LOCK_RESULT::ACQUIRED;
+        ScopedLock guard(*this, true, deadline);
+        if (guard.result != LOCK_RESULT::ACQUIRED)
+            return guard.result;
+        std::vector<LuaValWriteCombiner::Buffer> batches;
+        buffers->drain(batches);
+        for (auto& batch : batches) {
+            v.reserve(v.size() + batch.size());
+            while (!batch.empty()) {
+                auto node = batch.extract(batch.begin());
+                auto& pending = node.mapped();
+                if (pending.sum) {
+                    auto it = v.find(node.key());
+                    if (it != v.end() && LuaValWriteCombiner::isNumber(it->second.value))
+                        pending.value = std::make_unique<LuaVal<double>>(LuaValWriteCombiner::number(it->second.value) + LuaValWriteCombiner::number(pending.value));
+                }
+                writeEntry(std::move(node.key()), std::move(pending.value));
+            }
+        }
+        return LOCK_RESULT::ACQUIRED;
+    }
+
+    void setSpinCount(uint32_t spin_count) override {
+        spinCount.store(spin_count, std::memory_order_relaxed);
+    }
+
+    int Version(lua_State* L, int self_index) override {
+        lua_pushnumber(L, static_cast<lua_Number>(version.load(std::memory_order_acquire)));
+        return 1;
+    }
+
+    int TrackChanges(lua_State* L, int self_index, bool enable) override {
+        ScopedLock guard(*this, true);
+        if (guard.result != LOCK_RESULT::ACQUIRED)
+            return lockError(L, guard.result);
+        if (!enable)
+            changes.reset();
+        else if (!changes)
+            changes = std::make_unique<ChangeLog>(version.load(std::memory_order_relaxed));
         return 0;
     }
 
+    int Subscribe(lua_State* L, int self_index, int filter_index) override {
+        auto filter = AsLuaVal(L, filter_index, LockPolicy::STATUS);
+        auto subscription = std::make_shared<LuaValSubscription>(std::move(filter));
+        {
+            ScopedLock guard(*this, true);
+            if (guard.result != LOCK_RESULT::ACQUIRED)
+                return lockError(L, guard.result);
+            subscribers.push_back(subscription);
+        }
+        return pushLuaVal(L, new LuaValSubscription::Handle{ std::move(subscription) }, LUAVAL_SUBSCRIPTION_METATABLE_KEY);
+    }
+
+    // Pushes a list of keys written after since and the current version.
+    // The list is nil if change tracking did not cover the whole range and the table must be read again.
+    int ChangesSince(lua_State* L, int self_index, uint64_t since) override {
+        ScopedLock guard(*this, false);
+        if (guard.result != LOCK_RESULT::ACQUIRED)
+            return lockError(L, guard.result);
+        if (!changes || since < changes->trackedSince)
+        {
+            lua_pushnil(L);
+        }
+        else
+        {
+            lua_newtable(L);
+            int i = 0;
+            for (auto it = changes->byVersion.upper_bound(since); it != changes->byVersion.end(); ++it)
+            {
+                it->second->asObject(L);
+                lua_rawseti(L, -2, ++i);
+            }
+        }
+        lua_pushnumber(L, static_cast<lua_Number>(version.load(std::memory_order_relaxed)));
+        return 2;
+    }
+
+    bool isTable() const override {
+        return true;
+    }
+
+    LOCK_STATUS lockStatus() const override {
+        return LockPolicy::STATUS;
+    }
+
+    LOCK_RESULT lockTable(bool exclusive, LuaValLockWait::Clock::time_point deadline = LuaValLockWait::NO_DEADLINE) override {
+        if constexpr (!IS_LOCKED) {
+            return LOCK_RESULT::ACQUIRED;
+        }
+        else {
+            bool waited = true;
+            switch (LuaValLockHierarchy::classify(this, exclusive))
+            {
+            case LuaValLockHierarchy::ORDER::HELD:
+                LuaValLockHierarchy::retain(this);
+                return LOCK_RESULT::ACQUIRED;
+            case LuaValLockHierarchy::ORDER::UPGRADE:
+                return LOCK_RESULT::UPGRADE;
+            case LuaValLockHierarchy::ORDER::OUT_OF_ORDER:
+                // Waiting could deadlock with a thread that holds this table and waits for ours
+                if (deadline == LuaValLockWait::NO_DEADLINE) {
+                    waited = false;
+                    deadline = LuaValLockWait::Clock::now();
+                }
+                break;
+            default:
+                break;
+            }
+            bool acquired;
+            if (exclusive) {
+                std::unique_lock guard(lock, std::defer_lock);
+                acquired = acquire(guard, deadline);
+                guard.release();
+            }
+            else {
+                std::shared_lock guard(lock, std::defer_lock);
+                acquired = acquire(guard, deadline);
+                guard.release();
+            }
+            if (!acquired)
+                return waited ? LOCK_RESULT::BUSY : LOCK_RESULT::ORDER;
+            LuaValLockHierarchy::push(this, exclusive);
+            return LOCK_RESULT::ACQUIRED;
+        }
+    }
+
+    void unlockTable() override {
+        if constexpr (IS_LOCKED) {
+            bool exclusive = false;
+            if (!LuaValLockHierarchy::release(this, exclusive))
+                return;
+            if (exclusive)
+                lock.unlock();
+            else
+                lock.unlock_shared();
+        }
+    }
+
+    const MapEntry* findEntry(const std::unique_ptr<LuaValBase>& key) const override {
+        auto it = v.find(key);
+        if (it == v.end())
+            return nullptr;
+        return &it->second;
+    }
+
+    void writeEntry(std::unique_ptr<LuaValBase> key, std::unique_ptr<LuaValBase> value) override {
+        // Writers hold the exclusive lock so a plain increment is enough
+        uint64_t new_version = version.load(std::memory_order_relaxed) + 1;
+        version.store(new_version, std::memory_order_release);
+        if (changes)
+            changes->record(key, new_version);
+        if (!subscribers.empty())
+            notifySubscribers(key, value);
+        if (!value)
+            v.erase(key);
+        else
+            v.insert_or_assign(std::move(key), MapEntry{ std::move(value), new_version });
+    }
+
+    size_t bucketCount() const override {
+        return v.bucket_count();
+    }
+
+    void scanBuckets(size_t first, size_t last, const std::function<void(const LuaValBase& key, const LuaValBase& value)>& visit) const override {
+        for (size_t bucket = first; bucket < last; ++bucket) {
+            for (auto it = v.begin(bucket); it != v.end(bucket); ++it)
+                visit(*it->first, *it->second.value);
+        }
+    }
+
+    static int iterate_closure(lua_State* L)
+    {
+        if (!isLuaVal(L, 1, LUAVAL_ITERATOR_METATABLE_KEY)) {
+            return luaL_argerror(L, 1, "Trying to iterate using invalid iterator object");
+        }
+        auto state_tuple = getLuaVal<IteratorState>(L, 1);
+        if (std::get<0>(*state_tuple) == std::get<1>(*state_tuple))
+        {
+            // iteration ended
+            return 0;
+        }
+        auto oldit = std::get<0>(*state_tuple)++;
+        return oldit->first->asObject(L) + oldit->second.value->asObject(L);
+    }
+
     static int iterate_closure_locked(lua_State* L)
     {
         if (!isLuaVal(L, 1, LUAVAL_LOCKED_ITERATOR_METATABLE_KEY)) {
@@ -515,45 +1447,53 @@ public:
         auto state_tuple = getLuaVal<IteratorStateLocked>(L, 1);
         if (std::get<0>(*state_tuple) == std::get<1>(*state_tuple))
         {
-            // If iteration ended, free the mutex
-            // We also free the mutex in __gc method of the iterator
+            // If iteration ended, free the lock
+            // We also free the lock in __gc method of the iterator
             auto& guard = std::get<2>(*state_tuple);
             if (guard)
-                guard.unlock();
+                guard.reset();
             return 0;
         }
         auto oldit = std::get<0>(*state_tuple)++;
-        return oldit->first->asObject(L) + oldit->second->asObject(L);
+        return oldit->first->asObject(L) + oldit->second.value->asObject(L);
     }
 
     int iterate(lua_State* L, int self_index) override
     {
-        lua_pushcfunction(L, &iterate_closure_locked);
-        std::shared_lock guard(lock);
-        return 1 + pushLuaVal(L, new IteratorStateLocked(v.begin(), v.end(), std::move(guard)), LUAVAL_LOCKED_ITERATOR_METATABLE_KEY);
+        if constexpr (!IS_LOCKED) {
+            lua_pushcfunction(L, &iterate_closure);
+            return 1 + pushLuaVal(L, new IteratorState(v.begin(), v.end()), LUAVAL_ITERATOR_METATABLE_KEY);
+        }
+        else {
+            LOCK_RESULT result = lockTable(false);
+            if (result != LOCK_RESULT::ACQUIRED)
+                return lockError(L, result);
+            lua_pushcfunction(L, &iterate_closure_locked);
+            return 1 + pushLuaVal(L, new IteratorStateLocked(v.begin(), v.end(), SharedTableGuard(this)), LUAVAL_LOCKED_ITERATOR_METATABLE_KEY);
+        }
     }
 
     int pushAsLua(lua_State* L, uint32_t depth) override
     {
+        // Called with the table locked, see LuaValBase::pushAsLua
         lua_newtable(L);
-        std::shared_lock guard(lock);
         for (auto& it : v) {
             if (depth == 1)
             {
                 it.first->asObject(L);
-                it.second->asObject(L);
+                it.second.value->asObject(L);
                 lua_rawset(L, -3);
             }
             if (depth == 0)
             {
                 it.first->pushAsLua(L, depth);
-                it.second->pushAsLua(L, depth);
+                it.second.value->pushAsLua(L, depth);
                 lua_rawset(L, -3);
             }
             else
             {
                 it.first->pushAsLua(L, depth - 1);
-                it.second->pushAsLua(L, depth - 1);
+                it.second.value->pushAsLua(L, depth - 1);
                 lua_rawset(L, -3);
             }
         }
@@ -562,7 +1502,7 @@ public:
 
     int asObject(lua_State* L) override
     {
-        return pushLuaVal(L, new LuaValTableLocked(*this), LUAVAL_METATABLE_KEY);
+        return pushLuaVal(L, new LuaValTableT(*this), LUAVAL_METATABLE_KEY);
     }
 
     size_t LuaValHash() const override
@@ -576,11 +1516,11 @@ public:
         lua_pushnil(L);
         while (lua_next(L, real_idex))
         {
-            auto key = AsLuaVal(L, -2, LOCK_STATUS::LOCKED);
-            auto value = AsLuaVal(L, -1, LOCK_STATUS::LOCKED);
+            auto key = AsLuaVal(L, -2, LockPolicy::STATUS);
+            auto value = AsLuaVal(L, -1, LockPolicy::STATUS);
             // skip nil keys and values
             if (key && value)
-                v.emplace(std::move(key), std::move(value));
+                v.emplace(std::move(key), MapEntry{ std::move(value), ++version });
             lua_pop(L, 1);
         }
     }
@@ -589,88 +1529,2424 @@ public:
         if (typeid(*this) != typeid(other)) {
             return true;
         }
-        return &v < &static_cast<const LuaValTableLocked&>(other).v;
+        return &v < &static_cast<const LuaValTableT&>(other).v;
     }
     bool equalTo(const LuaValBase& other) const override {
         if (typeid(*this) != typeid(other)) {
             return false;
         }
-        return &v == &static_cast<const LuaValTableLocked&>(other).v;
+        return &v == &static_cast<const LuaValTableT&>(other).v;
     }
 
     std::unique_ptr<LuaValBase> clone() override {
-        auto c = std::make_unique<LuaValTableLocked>();
-        for (const auto& k_v : v) {
-            c->v[k_v.first->clone()] = k_v.second->clone();
-        }
-        return c;
+        return std::make_unique<LuaValTableT>(*this);
+    }
+
+    std::unique_ptr<LuaValBase> convertTo(LOCK_STATUS status) override {
+        return LuaValVisitLockPolicy(status, [&](auto policy) -> std::unique_ptr<LuaValBase> {
+            return std::make_unique<LuaValTableT<typename decltype(policy)::type>>(*this);
+        });
     }
 };
+template class LuaValTableT<LuaValNoLock>;
+template class LuaValTableT<LuaValSharedMutex>;
+template class LuaValTableT<LuaValSpinLock>;
+template class LuaValTableT<LuaValReaderBiasedLock>;
+template class LuaValTableT<LuaValFairLock>;
+
+typedef LuaValTableT<LuaValNoLock> LuaValTable;
+typedef LuaValTableT<LuaValSharedMutex> LuaValTableLocked;
+// Bounded channel for passing values between lua states.
+// The channel userdata is a handle, copying it into tables or other channels shares the same queue.
+// Pushed values are moved into the channel, see MoveLuaVal.
+class LuaValChannel : public LuaValBase
+{
+public:
+    typedef LuaValMPMCQueue<std::unique_ptr<LuaValBase>> QueueType;
 
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+    static constexpr size_t MAX_CAPACITY = size_t(1) << 24;
 
-LuaValTable::LuaValTable(LuaValTableLocked& lv) : LuaValBase(), v() {
-    std::shared_lock guard(lv.lock);
-    for (auto& it : lv.v)
-    {
-        v[it.first->clone()] = it.second->clone();
+    LuaValChannel(std::shared_ptr<QueueType> queue) : LuaValBase(), queue(std::move(queue)) {
     }
-}
-LuaValTableLocked::LuaValTableLocked(LuaValTable& lv) : LuaValBase(), v() {
-    for (auto& it : lv.v)
+
+    int asObject(lua_State* L) override
     {
-        v[it.first->clone()] = it.second->clone();
+        return pushLuaVal(L, new LuaValChannel(queue), LUAVAL_CHANNEL_METATABLE_KEY);
     }
-}
 
-std::unique_ptr<LuaValBase> LuaValBase::AsLuaVal(lua_State* L, int index, LOCK_STATUS status)
-{
-    auto t = lua_type(L, index);
-    switch (t)
-    {
-    case LUA_TBOOLEAN:
-        return std::make_unique<LuaVal<bool>>(lua_toboolean(L, index) != 0);
-    case LUA_TNIL:
-        [[fallthrough]];
-    case LUA_TNONE:
-        return nullptr;
-    case LUA_TNUMBER:
-        return std::make_unique<LuaVal<double>>(lua_tonumber(L, index));
-    case LUA_TSTRING:
+    int pushAsLua(lua_State* L, uint32_t depth) override
     {
-        size_t len;
-        const char* cstr = lua_tolstring(L, index, &len);
-        return std::make_unique<LuaVal<std::string>>(std::string(cstr, len));
+        return asObject(L);
     }
-    case LUA_TTABLE:
+
+    size_t LuaValHash() const override
     {
-        if (status == LOCK_STATUS::LOCKED) {
-            auto m = std::make_unique<LuaValTableLocked>();
-            m->FromTable(L, index);
-            return m;
-        }
-        else {
-            auto m = std::make_unique<LuaValTable>();
-            m->FromTable(L, index);
-            return m;
-        }
+        return std::hash<QueueType*>{}(queue.get());
     }
-    case LUA_TUSERDATA:
-    {
-        if (isLuaVal(L, index, LUAVAL_METATABLE_KEY))
-        {
-            LuaValBase* lv = getLuaVal<LuaValBase>(L, index);
-            if (status == LOCK_STATUS::LOCKED && typeid(*lv) == typeid(LuaValTable)) {
-                return std::make_unique<LuaValTableLocked>(*static_cast<LuaValTable*>(lv));
-            }
-            if (status == LOCK_STATUS::NOT_LOCKED && typeid(*lv) == typeid(LuaValTableLocked)) {
-                return std::make_unique<LuaValTable>(*static_cast<LuaValTableLocked*>(lv));
-            }
-            return lv->clone();
+
+    bool lessThan(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return true;
         }
-        [[fallthrough]];
+        return queue.get() < static_cast<const LuaValChannel&>(other).queue.get();
     }
-    default:
+    bool equalTo(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return false;
+        }
+        return queue == static_cast<const LuaValChannel&>(other).queue;
+    }
+
+    std::unique_ptr<LuaValBase> clone() override {
+        return std::make_unique<LuaValChannel>(queue);
+    }
+
+    // Lua functions
+
+    // LuaVal.channel([capacity]), the capacity is rounded up to a power of two of at least 2, see ch:capacity()
+    static int factory(lua_State* L)
+    {
+        lua_Integer capacity = luaL_optinteger(L, 1, DEFAULT_CAPACITY);
+        luaL_argcheck(L, capacity > 0, 1, "Channel capacity must be positive");
+        luaL_argcheck(L, static_cast<size_t>(capacity) <= MAX_CAPACITY, 1, "Channel capacity is too large");
+        return pushLuaVal(L, new LuaValChannel(std::make_shared<QueueType>(static_cast<size_t>(capacity))), LUAVAL_CHANNEL_METATABLE_KEY);
+    }
+
+    // ch:push(value [, timeoutMs]) waits for space until the timeout, returns false if the channel stayed full.
+    // Without a timeout it waits until there is space.
+    static int Push(lua_State* L)
+    {
+        constexpr int self_index = 1;
+        constexpr int val_index = 2;
+        constexpr int timeout_index = 3;
+        LuaValChannel* channel = checkLuaVal<LuaValChannel>(L, self_index, LUAVAL_CHANNEL_METATABLE_KEY);
+        if (lua_isnoneornil(L, val_index))
+            return luaL_argerror(L, val_index, "Trying to push nil");
+        auto deadline = lua_isnoneornil(L, timeout_index) ? LuaValLockWait::NO_DEADLINE : LuaValLockWait::deadlineAfter(luaL_checknumber(L, timeout_index));
+        auto value = MoveLuaVal(L, val_index);
+        bool pushed = channel->queue->tryPush(value) || LuaValLockWait::poll([&] { return channel->queue->tryPush(value); }, deadline);
+        if (!pushed && isLuaVal(L, val_index, LUAVAL_METATABLE_KEY))
+        {
+            // Give the value back to the caller
+            *(LuaValBase**)lua_touserdata(L, val_index) = value.release();
+        }
+        lua_pushboolean(L, pushed);
+        return 1;
+    }
+
+    // ch:pop([timeoutMs]) waits for a value until the timeout, returns nil if none arrived.
+    // Without a timeout it waits until there is a value.
+    static int Pop(lua_State* L)
+    {
+        constexpr int self_index = 1;
+        constexpr int timeout_index = 2;
+        LuaValChannel* channel = checkLuaVal<LuaValChannel>(L, self_index, LUAVAL_CHANNEL_METATABLE_KEY);
+        auto deadline = lua_isnoneornil(L, timeout_index) ? LuaValLockWait::NO_DEADLINE : LuaValLockWait::deadlineAfter(luaL_checknumber(L, timeout_index));
+        std::unique_ptr<LuaValBase> value;
+        LuaValLockWait::poll([&] { return channel->queue->tryPop(value); }, deadline);
+        return pushOwned(L, std::move(value));
+    }
+
+    // Attempts of ch:awaitPush(value) and ch:awaitPop(), see LuaValAwait
+    static int AttemptPush(lua_State* L)
+    {
+        constexpr int self_index = 1;
+        constexpr int val_index = 2;
+        lua_settop(L, val_index);
+        LuaValChannel* channel = checkLuaVal<LuaValChannel>(L, self_index, LUAVAL_CHANNEL_METATABLE_KEY);
+        if (lua_isnil(L, val_index))
+            return luaL_argerror(L, val_index, "Trying to push nil");
+        auto value = MoveLuaVal(L, val_index);
+        if (channel->queue->tryPush(value))
+            return 0;
+        if (isLuaVal(L, val_index, LUAVAL_METATABLE_KEY))
+            *(LuaValBase**)lua_touserdata(L, val_index) = value.release();
+        return LuaValAwait::BUSY;
+    }
+
+    static int AttemptPop(lua_State* L)
+    {
+        constexpr int self_index = 1;
+        lua_settop(L, self_index);
+        LuaValChannel* channel = checkLuaVal<LuaValChannel>(L, self_index, LUAVAL_CHANNEL_METATABLE_KEY);
+        std::unique_ptr<LuaValBase> value;
+        if (!channel->queue->tryPop(value))
+            return LuaValAwait::BUSY;
+        return pushOwned(L, std::move(value));
+    }
+
+    static int TryPop(lua_State* L)
+    {
+        constexpr int self_index = 1;
+        LuaValChannel* channel = checkLuaVal<LuaValChannel>(L, self_index, LUAVAL_CHANNEL_METATABLE_KEY);
+        std::unique_ptr<LuaValBase> value;
+        channel->queue->tryPop(value);
+        return pushOwned(L, std::move(value));
+    }
+
+    // ch:popBatch([max]) returns a list of up to max values that are available without waiting
+    static int PopBatch(lua_State* L)
+    {
+        constexpr int self_index = 1;
+        constexpr int max_index = 2;
+        LuaValChannel* channel = checkLuaVal<LuaValChannel>(L, self_index, LUAVAL_CHANNEL_METATABLE_KEY);
+        lua_Integer max = luaL_optinteger(L, max_index, static_cast<lua_Integer>(channel->queue->capacity()));
+        lua_newtable(L);
+        std::unique_ptr<LuaValBase> value;
+        lua_Integer count = 0;
+        while (count < max && channel->queue->tryPop(value))
+        {
+            pushOwned(L, std::move(value));
+            lua_rawseti(L, -2, ++count);
+        }
+        return 1;
+    }
+
+    static int Size(lua_State* L)
+    {
+        LuaValChannel* channel = checkLuaVal<LuaValChannel>(L, 1, LUAVAL_CHANNEL_METATABLE_KEY);
+        lua_pushnumber(L, static_cast<lua_Number>(channel->queue->size()));
+        return 1;
+    }
+
+    static int Capacity(lua_State* L)
+    {
+        LuaValChannel* channel = checkLuaVal<LuaValChannel>(L, 1, LUAVAL_CHANNEL_METATABLE_KEY);
+        lua_pushnumber(L, static_cast<lua_Number>(channel->queue->capacity()));
+        return 1;
+    }
+
+protected:
+    std::shared_ptr<QueueType> queue;
+};
+
+// Object owned by a lua state, kept in its registry under key and deleted when the state is closed.
+// Coroutines share the registry of their state and find the same object.
+template<typename T>
+class LuaValStateLocal
+{
+public:
+    static T* find(lua_State* L, const char* key)
+    {
+        lua_getfield(L, LUA_REGISTRYINDEX, key);
+        T** ptr = static_cast<T**>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        return ptr ? *ptr : nullptr;
+    }
+
+    // Replaces the object of the state, a replaced object is deleted when it is collected
+    static T& set(lua_State* L, const char* key, std::unique_ptr<T> value)
+    {
+        T** ptr = static_cast<T**>(lua_newuserdata(L, sizeof(T*)));
+        *ptr = nullptr;
+        lua_newtable(L);
+        lua_pushcfunction(L, &gc);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        *ptr = value.release();
+        lua_setfield(L, LUA_REGISTRYINDEX, key);
+        return **ptr;
+    }
+
+private:
+    static int gc(lua_State* L)
+    {
+        delete *static_cast<T**>(lua_touserdata(L, 1));
+        return 0;
+    }
+};
+
+// Runs jobs on the thread of a lua state, future continuations are posted to it.
+// Each state has its own, so jobs only see the registry references of the state that posted them.
+// LuaHost installs one on its worker states, other states queue the jobs until LuaVal.dispatch runs them.
+class LuaValExecutor
+{
+public:
+    typedef std::function<void(lua_State*)> Job;
+
+    static constexpr const char* REGISTRY_KEY = "LuaVal Executor";
+
+    virtual ~LuaValExecutor() {
+    }
+
+    // Called from any thread. Jobs must catch their own lua errors.
+    virtual void post(Job job) = 0;
+
+    // Called by jobs with a caught error message on top of the stack, pops it
+    virtual void reportError(lua_State* L) = 0;
+
+    // Called when the state of the executor is closed, jobs posted afterwards are dropped
+    virtual void detach() = 0;
+
+    // Executor of the state, a LuaValQueueExecutor unless one was installed
+    static std::shared_ptr<LuaValExecutor> current(lua_State* L);
+
+    static void install(lua_State* L, std::shared_ptr<LuaValExecutor> executor) {
+        LuaValStateLocal<Owner>::set(L, REGISTRY_KEY, std::make_unique<Owner>(std::move(executor)));
+    }
+
+private:
+    // Detaches the executor with the state, continuations may still hold it
+    struct Owner {
+        Owner(std::shared_ptr<LuaValExecutor> executor) : executor(std::move(executor)) {
+        }
+        ~Owner() {
+            executor->detach();
+        }
+        std::shared_ptr<LuaValExecutor> executor;
+    };
+};
+
+class LuaValQueueExecutor : public LuaValExecutor
+{
+public:
+    void post(Job job) override {
+        std::lock_guard guard(mutex);
+        if (!detached)
+            jobs.push_back(std::move(job));
+    }
+
+    void detach() override {
+        std::deque<Job> dropped;
+        std::lock_guard guard(mutex);
+        detached = true;
+        dropped.swap(jobs);
+    }
+
+    // Keeps the first error until takeError
+    void reportError(lua_State* L) override {
+        const char* message = lua_tostring(L, -1);
+        if (error.empty())
+            error = message ? message : "(error object is not a string)";
+        lua_pop(L, 1);
+    }
+
+    std::string takeError() {
+        std::string first;
+        first.swap(error);
+        return first;
+    }
+
+    // Runs the jobs queued so far and returns their count
+    size_t run(lua_State* L) {
+        std::deque<Job> queued;
+        {
+            std::lock_guard guard(mutex);
+            queued.swap(jobs);
+        }
+        for (auto& job : queued)
+            job(L);
+        return queued.size();
+    }
+
+private:
+    std::mutex mutex;
+    std::deque<Job> jobs;
+    bool detached = false;
+    // Only used by the owning thread
+    std::string error;
+};
+
+inline std::shared_ptr<LuaValExecutor> LuaValExecutor::current(lua_State* L)
+{
+    if (Owner* owner = LuaValStateLocal<Owner>::find(L, REGISTRY_KEY))
+        return owner->executor;
+    std::shared_ptr<LuaValExecutor> executor = std::make_shared<LuaValQueueExecutor>();
+    install(L, executor);
+    return executor;
+}
+
+// Lets a thread run other work while it waits for a future, installed by LuaHost on its workers
+class LuaValWaitHelper
+{
+public:
+    virtual ~LuaValWaitHelper() {
+    }
+
+    // Runs one piece of pending work on L, returns false if there was none or the waits nest too deep
+    virtual bool helpOnce(lua_State* L) = 0;
+
+    static LuaValWaitHelper*& current() {
+        thread_local LuaValWaitHelper* helper = nullptr;
+        return helper;
+    }
+};
+
+// Timers of a lua state, kept in its registry and dropped with it.
+// Timers fire on the state that created them when it dispatches, from the host loop on
+// LuaHost workers and from LuaVal.dispatch elsewhere. Expired callbacks run in one batch per dispatch.
+class LuaValTimers
+{
+public:
+    typedef LuaValTimerWheel<int> Wheel;
+    // Called with the error message on top of the stack, must pop it
+    typedef std::function<void(lua_State*)> ErrorHandler;
+
+    static constexpr const char* REGISTRY_KEY = "LuaVal Timers";
+
+    LuaValTimers() : wheel(), start(LuaValLockWait::Clock::now()), firing() {
+    }
+
+    static LuaValTimers& current(lua_State* L) {
+        if (LuaValTimers* timers = LuaValStateLocal<LuaValTimers>::find(L, REGISTRY_KEY))
+            return *timers;
+        return LuaValStateLocal<LuaValTimers>::set(L, REGISTRY_KEY, std::make_unique<LuaValTimers>());
+    }
+
+    size_t size() const {
+        return wheel.size();
+    }
+
+    // Runs the callbacks of the timers that expired since the last dispatch and returns their count
+    size_t dispatch(lua_State* L, const ErrorHandler& on_error) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(LuaValLockWait::Clock::now() - start);
+        std::vector<Wheel::Expired> expired;
+        wheel.advance(static_cast<uint64_t>(elapsed.count()), expired);
+        for (auto& timer : expired) {
+            if (!timer.periodic)
+                firing.insert(timer.id);
+        }
+        for (auto& timer : expired) {
+            // A callback may have cancelled a later timer of the same batch
+            bool cancelled = timer.periodic ? !wheel.contains(timer.id) : firing.erase(timer.id) == 0;
+            if (!cancelled) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, timer.payload);
+                lua_pushnumber(L, static_cast<lua_Number>(timer.id));
+                if (lua_pcall(L, 1, 0, 0) != 0)
+                    on_error(L);
+            }
+            if (!timer.periodic)
+                luaL_unref(L, LUA_REGISTRYINDEX, timer.payload);
+        }
+        return expired.size();
+    }
+
+    // Lua functions
+
+    // LuaVal.after(ms, fn) calls fn(id) once after ms milliseconds and returns the timer id
+    static int After(lua_State* L) {
+        return add(L, false);
+    }
+
+    // LuaVal.every(ms, fn) calls fn(id) every ms milliseconds until the timer is cancelled
+    static int Every(lua_State* L) {
+        return add(L, true);
+    }
+
+    // LuaVal.cancel(id) returns false if the timer already fired or was cancelled
+    static int Cancel(lua_State* L) {
+        constexpr int id_index = 1;
+        lua_Number id = luaL_checknumber(L, id_index);
+        if (id < 0) {
+            lua_pushboolean(L, false);
+            return 1;
+        }
+        LuaValTimers& timers = current(L);
+        int ref = LUA_NOREF;
+        bool cancelled = timers.wheel.cancel(static_cast<uint64_t>(id), ref);
+        // One shot timers of the batch being dispatched already left the wheel, dispatch skips them
+        if (cancelled)
+            luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        else
+            cancelled = timers.firing.erase(static_cast<uint64_t>(id)) != 0;
+        lua_pushboolean(L, cancelled);
+        return 1;
+    }
+
+private:
+    static int add(lua_State* L, bool periodic) {
+        constexpr int delay_index = 1;
+        constexpr int func_index = 2;
+        lua_Number delay = luaL_checknumber(L, delay_index);
+        luaL_argcheck(L, delay >= 0 && delay <= static_cast<lua_Number>(Wheel::MAX_DELAY), delay_index, "Timer delay out of range");
+        luaL_checktype(L, func_index, LUA_TFUNCTION);
+        uint64_t ticks = static_cast<uint64_t>(std::ceil(delay));
+        lua_pushvalue(L, func_index);
+        int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        uint64_t id = current(L).wheel.add(ticks, periodic ? ticks : 0, ref);
+        lua_pushnumber(L, static_cast<lua_Number>(id));
+        return 1;
+    }
+
+    Wheel wheel;
+    LuaValLockWait::Clock::time_point start;
+    // One shot timers of the dispatched batch that did not run yet
+    std::unordered_set<uint64_t> firing;
+};
+
+// Result of asynchronous work, completed once from any thread and read from any state.
+// The userdata is a handle, copying it into tables or channels shares the same result.
+class LuaValFuture : public LuaValBase
+{
+public:
+    typedef std::vector<std::unique_ptr<LuaValBase>> Values;
+
+    struct State {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::atomic<bool> ready{ false };
+        bool failed = false;
+        // Not modified after ready is set
+        Values values;
+        std::string error;
+        std::vector<std::function<void()>> callbacks;
+
+        // Returns false if the future was already completed
+        bool complete(Values result) {
+            std::vector<std::function<void()>> run;
+            {
+                std::lock_guard guard(mutex);
+                if (ready.load(std::memory_order_relaxed))
+                    return false;
+                values = std::move(result);
+                ready.store(true, std::memory_order_release);
+                run.swap(callbacks);
+            }
+            cv.notify_all();
+            for (auto& callback : run)
+                callback();
+            return true;
+        }
+
+        bool fail(std::string message) {
+            std::vector<std::function<void()>> run;
+            {
+                std::lock_guard guard(mutex);
+                if (ready.load(std::memory_order_relaxed))
+                    return false;
+                failed = true;
+                error = std::move(message);
+                ready.store(true, std::memory_order_release);
+                run.swap(callbacks);
+            }
+            cv.notify_all();
+            for (auto& callback : run)
+                callback();
+            return true;
+        }
+
+        // Calls callback on the completing thread once the future is ready, or right away if it is
+        void onReady(std::function<void()> callback) {
+            {
+                std::lock_guard guard(mutex);
+                if (!ready.load(std::memory_order_relaxed)) {
+                    callbacks.push_back(std::move(callback));
+                    return;
+                }
+            }
+            callback();
+        }
+
+        Values copyValues() const {
+            Values copies;
+            copies.reserve(values.size());
+            for (auto& value : values)
+                copies.push_back(value ? value->clone() : nullptr);
+            return copies;
+        }
+
+        bool isReady() const {
+            return ready.load(std::memory_order_acquire);
+        }
+
+        // Waits until the future is ready or the deadline passes and returns whether it is ready.
+        // With a LuaValWaitHelper the thread runs other work on L while waiting.
+        bool wait(lua_State* L, LuaValLockWait::Clock::time_point deadline = LuaValLockWait::NO_DEADLINE) {
+            LuaValWaitHelper* helper = LuaValWaitHelper::current();
+            while (!isReady()) {
+                if (helper && helper->helpOnce(L))
+                    continue;
+                auto now = LuaValLockWait::Clock::now();
+                if (now >= deadline)
+                    return false;
+                // Helpers wake up regularly to check for new work
+                auto wake = helper ? (std::min)(deadline, now + std::chrono::milliseconds(1)) : deadline;
+                std::unique_lock guard(mutex);
+                if (wake == LuaValLockWait::NO_DEADLINE)
+                    cv.wait(guard, [this] { return isReady(); });
+                else
+                    cv.wait_until(guard, wake, [this] { return isReady(); });
+            }
+            return true;
+        }
+
+        // Pushes copies of the values of a ready future, raises the error of a failed one
+        int push(lua_State* L) {
+            if (failed)
+                return luaL_error(L, "%s", error.c_str());
+            luaL_checkstack(L, static_cast<int>(values.size()), "Too many future values");
+            for (auto& value : values) {
+                if (value)
+                    value->asObject(L);
+                else
+                    lua_pushnil(L);
+            }
+            return static_cast<int>(values.size());
+        }
+    };
+
+    LuaValFuture(std::shared_ptr<State> state) : LuaValBase(), state(std::move(state)) {
+    }
+
+    int asObject(lua_State* L) override {
+        return pushLuaVal(L, new LuaValFuture(state), LUAVAL_FUTURE_METATABLE_KEY);
+    }
+
+    int pushAsLua(lua_State* L, uint32_t depth) override {
+        return asObject(L);
+    }
+
+    size_t LuaValHash() const override {
+        return std::hash<State*>{}(state.get());
+    }
+
+    bool lessThan(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return true;
+        }
+        return state.get() < static_cast<const LuaValFuture&>(other).state.get();
+    }
+    bool equalTo(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return false;
+        }
+        return state.get() == static_cast<const LuaValFuture&>(other).state.get();
+    }
+
+    std::unique_ptr<LuaValBase> clone() override {
+        return std::make_unique<LuaValFuture>(state);
+    }
+
+    // Lua functions
+
+    // future:poll() returns false while the future is pending and true followed by its values when it is ready
+    static int Poll(lua_State* L) {
+        LuaValFuture* future = checkLuaVal<LuaValFuture>(L, 1, LUAVAL_FUTURE_METATABLE_KEY);
+        if (!future->state->isReady()) {
+            lua_pushboolean(L, 0);
+            return 1;
+        }
+        lua_pushboolean(L, 1);
+        return 1 + future->state->push(L);
+    }
+
+    // Attempt of future:wait([timeoutMs]), returns the values of the future or nothing if the timeout passed.
+    // Without a timeout a coroutine resumed by LuaHost yields until the future is ready, see LuaValAwait.
+    static int AttemptWait(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int timeout_index = 2;
+        LuaValFuture* future = checkLuaVal<LuaValFuture>(L, self_index, LUAVAL_FUTURE_METATABLE_KEY);
+        // Keep the state alive, the userdata could be collected by work run while waiting
+        std::shared_ptr<State> state = future->state;
+        if (!state->isReady()) {
+            bool timed = !lua_isnoneornil(L, timeout_index);
+            if (!timed && LuaValAwait::canYield(L))
+                return LuaValAwait::BUSY;
+            auto deadline = timed ? LuaValLockWait::deadlineAfter(luaL_checknumber(L, timeout_index)) : LuaValLockWait::NO_DEADLINE;
+            if (!state->wait(L, deadline))
+                return 0;
+        }
+        if (state->failed) {
+            lua_pushstring(L, state->error.c_str());
+            state.reset();
+            return lua_error(L);
+        }
+        return state->push(L);
+    }
+
+    // LuaVal.future() returns a pending future, any state holding a copy of it can complete it
+    static int factory(lua_State* L) {
+        return pushLuaVal(L, new LuaValFuture(std::make_shared<State>()), LUAVAL_FUTURE_METATABLE_KEY);
+    }
+
+    // future:set(...) completes the future with copies of the values, returns false if it was already completed
+    static int SetValues(lua_State* L) {
+        constexpr int self_index = 1;
+        LuaValFuture* future = checkLuaVal<LuaValFuture>(L, self_index, LUAVAL_FUTURE_METATABLE_KEY);
+        Values values;
+        int top = lua_gettop(L);
+        for (int i = self_index + 1; i <= top; ++i)
+            values.push_back(AsLuaVal(L, i, LOCK_STATUS::NOT_LOCKED));
+        lua_pushboolean(L, future->state->complete(std::move(values)));
+        return 1;
+    }
+
+    // future:fail(message) makes waiting on the future raise message
+    static int Fail(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int message_index = 2;
+        LuaValFuture* future = checkLuaVal<LuaValFuture>(L, self_index, LUAVAL_FUTURE_METATABLE_KEY);
+        std::string message = luaL_checkstring(L, message_index);
+        lua_pushboolean(L, future->state->fail(std::move(message)));
+        return 1;
+    }
+
+    // future:next(onValue [, onError]) calls onValue with the values of the future, or onError with its error,
+    // on the calling state once the future is ready. Returns a future of the handler's results.
+    // Without onError the error is passed on to the returned future.
+    // Continuations run from the host loop on worker states and from LuaVal.dispatch elsewhere.
+    static int Then(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int value_index = 2;
+        constexpr int error_index = 3;
+        LuaValFuture* future = checkLuaVal<LuaValFuture>(L, self_index, LUAVAL_FUTURE_METATABLE_KEY);
+        luaL_checktype(L, value_index, LUA_TFUNCTION);
+        if (!lua_isnoneornil(L, error_index))
+            luaL_checktype(L, error_index, LUA_TFUNCTION);
+        auto continuation = std::make_shared<Continuation>();
+        continuation->source = future->state;
+        continuation->next = std::make_shared<State>();
+        lua_pushvalue(L, value_index);
+        continuation->onValue = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (lua_isnoneornil(L, error_index)) {
+            continuation->onError = LUA_NOREF;
+        }
+        else {
+            lua_pushvalue(L, error_index);
+            continuation->onError = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+        std::shared_ptr<LuaValExecutor> executor = LuaValExecutor::current(L);
+        future->state->onReady([executor, continuation] {
+            executor->post([continuation](lua_State* L) {
+                lua_pushcfunction(L, &runContinuation);
+                lua_pushlightuserdata(L, continuation.get());
+                if (lua_pcall(L, 1, 0, 0) != 0) {
+                    const char* message = lua_tostring(L, -1);
+                    continuation->next->fail(message ? message : "(error object is not a string)");
+                    lua_pop(L, 1);
+                }
+                luaL_unref(L, LUA_REGISTRYINDEX, continuation->onValue);
+                luaL_unref(L, LUA_REGISTRYINDEX, continuation->onError);
+            });
+        });
+        return pushLuaVal(L, new LuaValFuture(continuation->next), LUAVAL_FUTURE_METATABLE_KEY);
+    }
+
+    // LuaVal.whenAll({ f1, f2, ... }) returns a future of the first value of each future, in order.
+    // It fails with the first error of the futures.
+    static int WhenAll(lua_State* L) {
+        constexpr int list_index = 1;
+        luaL_checktype(L, list_index, LUA_TTABLE);
+        std::vector<std::shared_ptr<State>> sources;
+        for (int i = 1; ; ++i) {
+            lua_rawgeti(L, list_index, i);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                break;
+            }
+            sources.push_back(checkLuaVal<LuaValFuture>(L, -1, LUAVAL_FUTURE_METATABLE_KEY)->state);
+            lua_pop(L, 1);
+        }
+        auto all = std::make_shared<State>();
+        if (sources.empty()) {
+            all->complete(Values());
+            return pushLuaVal(L, new LuaValFuture(all), LUAVAL_FUTURE_METATABLE_KEY);
+        }
+        struct FanIn {
+            Values values;
+            std::atomic<size_t> remaining;
+        };
+        auto fan_in = std::make_shared<FanIn>();
+        fan_in->values.resize(sources.size());
+        fan_in->remaining = sources.size();
+        for (size_t i = 0; i < sources.size(); ++i) {
+            State* source = sources[i].get();
+            source->onReady([all, fan_in, source, i] {
+                if (source->failed) {
+                    all->fail(source->error);
+                    return;
+                }
+                if (!source->values.empty() && source->values[0])
+                    fan_in->values[i] = source->values[0]->clone();
+                if (fan_in->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    all->complete(std::move(fan_in->values));
+            });
+        }
+        return pushLuaVal(L, new LuaValFuture(all), LUAVAL_FUTURE_METATABLE_KEY);
+    }
+
+    // LuaVal.dispatch() runs the continuations queued for the calling state and the expired timers,
+    // returns how many ran. Worker states of LuaHost run them automatically.
+    // Callbacks that fail do not stop the others, the first error is raised afterwards.
+    static int Dispatch(lua_State* L) {
+        auto queue = std::dynamic_pointer_cast<LuaValQueueExecutor>(LuaValExecutor::current(L));
+        size_t count = 0;
+        bool failed = false;
+        if (queue) {
+            count = queue->run(L);
+            std::string error = queue->takeError();
+            if (!error.empty()) {
+                lua_pushstring(L, error.c_str());
+                failed = true;
+            }
+        }
+        count += LuaValTimers::current(L).dispatch(L, [&](lua_State* L) {
+            // Keep the first message on the stack, callbacks leave the stack balanced
+            if (failed)
+                lua_pop(L, 1);
+            failed = true;
+        });
+        if (failed)
+            return lua_error(L);
+        lua_pushnumber(L, static_cast<lua_Number>(count));
+        return 1;
+    }
+
+    static int Ready(lua_State* L) {
+        LuaValFuture* future = checkLuaVal<LuaValFuture>(L, 1, LUAVAL_FUTURE_METATABLE_KEY);
+        lua_pushboolean(L, future->state->isReady());
+        return 1;
+    }
+
+protected:
+    struct Continuation {
+        std::shared_ptr<State> source;
+        std::shared_ptr<State> next;
+        int onValue;
+        int onError;
+    };
+
+    // Runs a continuation under lua_pcall, completing its future with the handler's results
+    static int runContinuation(lua_State* L) {
+        Continuation* continuation = static_cast<Continuation*>(lua_touserdata(L, 1));
+        lua_settop(L, 0);
+        State& source = *continuation->source;
+        if (source.failed && continuation->onError == LUA_NOREF) {
+            continuation->next->fail(source.error);
+            return 0;
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, source.failed ? continuation->onError : continuation->onValue);
+        int args = 1;
+        if (source.failed)
+            lua_pushstring(L, source.error.c_str());
+        else
+            args = source.push(L);
+        lua_call(L, args, LUA_MULTRET);
+        Values results;
+        int top = lua_gettop(L);
+        for (int i = 1; i <= top; ++i)
+            results.push_back(AsLuaVal(L, i, LOCK_STATUS::NOT_LOCKED));
+        continuation->next->complete(std::move(results));
+        return 0;
+    }
+
+    std::shared_ptr<State> state;
+};
+
+// Mailbox of an actor living on a lua state, created with LuaVal.actor(handler).
+// Any state can send messages to it by handle or id. Messages are moved into a lock-free queue
+// and the owning state's executor drains them in batches, calling handler(message, id) for each.
+// The userdata is a handle, copying it into tables, channels or messages shares the mailbox.
+// Actors are closed when their state is closed.
+class LuaValActor : public LuaValBase
+{
+public:
+    typedef LuaValMPSCQueue<std::unique_ptr<LuaValBase>> QueueType;
+
+    // Messages delivered per drain before other work of the state gets a turn
+    static constexpr size_t DRAIN_BATCH = 256;
+
+    struct Mailbox : public std::enable_shared_from_this<Mailbox> {
+        uint64_t id = 0;
+        QueueType queue;
+        std::atomic<bool> scheduled{ false };
+        std::atomic<bool> closed{ false };
+        std::shared_ptr<LuaValExecutor> owner;
+        // Registry reference in the owning state
+        int handler = LUA_NOREF;
+
+        // Called from any thread, returns false and keeps message if the actor is closed
+        bool send(std::unique_ptr<LuaValBase>& message) {
+            if (closed.load(std::memory_order_acquire))
+                return false;
+            queue.push(std::move(message));
+            schedule();
+            return true;
+        }
+
+        // Posts a drain to the owner unless one is already pending
+        void schedule() {
+            if (!scheduled.exchange(true, std::memory_order_acq_rel))
+                owner->post([mailbox = shared_from_this()](lua_State* L) { mailbox->drain(L); });
+        }
+
+        void drain(lua_State* L) {
+            // Senders that find the flag set pushed before this exchange and are seen by the pops below
+            scheduled.exchange(false, std::memory_order_acq_rel);
+            std::unique_ptr<LuaValBase> message;
+            size_t count = 0;
+            while (count < DRAIN_BATCH && !closed.load(std::memory_order_acquire) && queue.tryPop(message)) {
+                ++count;
+                lua_rawgeti(L, LUA_REGISTRYINDEX, handler);
+                pushOwned(L, std::move(message));
+                lua_pushnumber(L, static_cast<lua_Number>(id));
+                if (lua_pcall(L, 2, 0, 0) != 0)
+                    owner->reportError(L);
+            }
+            if (count == DRAIN_BATCH)
+                schedule();
+        }
+    };
+
+    LuaValActor(std::shared_ptr<Mailbox> mailbox) : LuaValBase(), mailbox(std::move(mailbox)) {
+    }
+
+    static std::shared_ptr<Mailbox> find(uint64_t id) {
+        std::lock_guard guard(mutex());
+        auto it = mailboxes().find(id);
+        return it == mailboxes().end() ? nullptr : it->second;
+    }
+
+    int asObject(lua_State* L) override {
+        return pushLuaVal(L, new LuaValActor(mailbox), LUAVAL_ACTOR_METATABLE_KEY);
+    }
+
+    int pushAsLua(lua_State* L, uint32_t depth) override {
+        return asObject(L);
+    }
+
+    size_t LuaValHash() const override {
+        return std::hash<Mailbox*>{}(mailbox.get());
+    }
+
+    bool lessThan(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return true;
+        }
+        return mailbox.get() < static_cast<const LuaValActor&>(other).mailbox.get();
+    }
+    bool equalTo(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return false;
+        }
+        return mailbox == static_cast<const LuaValActor&>(other).mailbox;
+    }
+
+    std::unique_ptr<LuaValBase> clone() override {
+        return std::make_unique<LuaValActor>(mailbox);
+    }
+
+    // Lua functions
+
+    // LuaVal.actor(handler) creates an actor on the calling state and returns its handle
+    static int factory(lua_State* L) {
+        constexpr int handler_index = 1;
+        luaL_checktype(L, handler_index, LUA_TFUNCTION);
+        auto mailbox = std::make_shared<Mailbox>();
+        mailbox->owner = LuaValExecutor::current(L);
+        Owned& owned = Owned::current(L);
+        lua_pushvalue(L, handler_index);
+        mailbox->handler = luaL_ref(L, LUA_REGISTRYINDEX);
+        {
+            std::lock_guard guard(mutex());
+            mailbox->id = ++lastId();
+            mailboxes()[mailbox->id] = mailbox;
+            owned.ids.insert(mailbox->id);
+        }
+        return pushLuaVal(L, new LuaValActor(std::move(mailbox)), LUAVAL_ACTOR_METATABLE_KEY);
+    }
+
+    // LuaVal.send(actor, message) moves message to the mailbox of an actor given by handle or id.
+    // Returns false if there is no such actor.
+    static int Send(lua_State* L) {
+        constexpr int actor_index = 1;
+        constexpr int message_index = 2;
+        std::shared_ptr<Mailbox> target;
+        if (isLuaVal(L, actor_index, LUAVAL_ACTOR_METATABLE_KEY))
+            target = checkLuaVal<LuaValActor>(L, actor_index, LUAVAL_ACTOR_METATABLE_KEY)->mailbox;
+        else
+            target = find(static_cast<uint64_t>(luaL_checknumber(L, actor_index)));
+        if (lua_isnoneornil(L, message_index))
+            return luaL_argerror(L, message_index, "Trying to send nil");
+        auto message = MoveLuaVal(L, message_index);
+        bool sent = target && target->send(message);
+        if (!sent && isLuaVal(L, message_index, LUAVAL_METATABLE_KEY))
+            *(LuaValBase**)lua_touserdata(L, message_index) = message.release();
+        lua_pushboolean(L, sent);
+        return 1;
+    }
+
+    static int Id(lua_State* L) {
+        LuaValActor* actor = checkLuaVal<LuaValActor>(L, 1, LUAVAL_ACTOR_METATABLE_KEY);
+        lua_pushnumber(L, static_cast<lua_Number>(actor->mailbox->id));
+        return 1;
+    }
+
+    // actor:close() stops delivery and drops the pending messages, only the owning state can close an actor
+    static int Close(lua_State* L) {
+        LuaValActor* actor = checkLuaVal<LuaValActor>(L, 1, LUAVAL_ACTOR_METATABLE_KEY);
+        Mailbox& mailbox = *actor->mailbox;
+        if (mailbox.owner != LuaValExecutor::current(L))
+            return luaL_error(L, "Actors can only be closed by their owning state");
+        if (mailbox.closed.exchange(true, std::memory_order_acq_rel))
+            return 0;
+        Owned& owned = Owned::current(L);
+        {
+            std::lock_guard guard(mutex());
+            mailboxes().erase(mailbox.id);
+            owned.ids.erase(mailbox.id);
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, mailbox.handler);
+        mailbox.handler = LUA_NOREF;
+        return 0;
+    }
+
+protected:
+    // Actors of a lua state, closed when the state is closed since their handlers go with it
+    struct Owned {
+        static constexpr const char* REGISTRY_KEY = "LuaVal Actors";
+
+        static Owned& current(lua_State* L) {
+            if (Owned* owned = LuaValStateLocal<Owned>::find(L, REGISTRY_KEY))
+                return *owned;
+            return LuaValStateLocal<Owned>::set(L, REGISTRY_KEY, std::make_unique<Owned>());
+        }
+
+        ~Owned() {
+            std::lock_guard guard(mutex());
+            for (uint64_t id : ids) {
+                auto it = mailboxes().find(id);
+                if (it == mailboxes().end())
+                    continue;
+                it->second->closed.store(true, std::memory_order_release);
+                it->second->handler = LUA_NOREF;
+                mailboxes().erase(it);
+            }
+        }
+
+        // Guarded by mutex
+        std::unordered_set<uint64_t> ids;
+    };
+
+    static std::mutex& mutex() {
+        static std::mutex actors_mutex;
+        return actors_mutex;
+    }
+    static std::unordered_map<uint64_t, std::shared_ptr<Mailbox>>& mailboxes() {
+        static std::unordered_map<uint64_t, std::shared_ptr<Mailbox>> actor_mailboxes;
+        return actor_mailboxes;
+    }
+    static uint64_t& lastId() {
+        static uint64_t actor_last_id = 0;
+        return actor_last_id;
+    }
+
+    std::shared_ptr<Mailbox> mailbox;
+};
+
+// Read only view of a value that is not written anymore, such as a table of a double buffered frame.
+// Reading a nested table returns a view of it sharing the whole value instead of a copy.
+// Iterating a view copies the nested tables it returns like any LuaVal table.
+// Copying the view into tables or channels shares the value, writing through it raises an error.
+class LuaValFrozen : public LuaValBase
+{
+public:
+    LuaValFrozen(std::shared_ptr<const LuaValBase> target) : LuaValBase(), target(std::move(target)) {
+    }
+
+    // Pushes value, tables as views keeping owner alive
+    static int push(lua_State* L, const std::shared_ptr<const LuaValBase>& owner, const LuaValBase* value) {
+        if (!value) {
+            lua_pushnil(L);
+            return 1;
+        }
+        if (value->isTable())
+            return pushLuaVal(L, new LuaValFrozen(std::shared_ptr<const LuaValBase>(owner, value)), LUAVAL_METATABLE_KEY);
+        // Only missing const, pushing a value does not write to it
+        return const_cast<LuaValBase*>(value)->asObject(L);
+    }
+
+    // Copy of value to store in a table, tables are shared as views
+    static std::unique_ptr<LuaValBase> share(const std::shared_ptr<const LuaValBase>& value) {
+        if (value->isTable())
+            return std::make_unique<LuaValFrozen>(value);
+        return const_cast<LuaValBase&>(*value).clone();
+    }
+
+    int Get(lua_State* L, int self_index, int key_index) override {
+        auto klv = AsLuaVal(L, key_index, LOCK_STATUS::NOT_LOCKED);
+        if (!klv)
+            return luaL_argerror(L, key_index, "Table key is nil");
+        auto entry = target->findEntry(klv);
+        return push(L, target, entry ? entry->value.get() : nullptr);
+    }
+
+    int Set(lua_State* L, int self_index, int key_index, int val_index) override {
+        return luaL_argerror(L, self_index, "Trying to write to a frozen table");
+    }
+
+    // Calls the wrapped iterator function, the upvalue keeps the iterated value alive
+    static int iterate_pinned(lua_State* L)
+    {
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_insert(L, 1);
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+
+    // Wraps the iterator function below the n values on top of the stack so it keeps the value at owner_index alive
+    static int pinIterator(lua_State* L, int owner_index, int n)
+    {
+        lua_pushvalue(L, owner_index);
+        lua_pushvalue(L, -n - 1);
+        lua_pushcclosure(L, &iterate_pinned, 2);
+        lua_replace(L, -n - 1);
+        return n;
+    }
+
+    int iterate(lua_State* L, int self_index) override {
+        int owner_index = abs_index(L, self_index);
+        int n = const_cast<LuaValBase&>(*target).iterate(L, owner_index);
+        return pinIterator(L, owner_index, n);
+    }
+
+    int pushAsLua(lua_State* L, uint32_t depth) override {
+        return const_cast<LuaValBase&>(*target).pushAsLua(L, depth);
+    }
+
+    int asObject(lua_State* L) override {
+        return pushLuaVal(L, new LuaValFrozen(target), LUAVAL_METATABLE_KEY);
+    }
+
+    size_t LuaValHash() const override {
+        return std::hash<const LuaValBase*>{}(target.get());
+    }
+
+    bool lessThan(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return true;
+        }
+        return target.get() < static_cast<const LuaValFrozen&>(other).target.get();
+    }
+    bool equalTo(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return false;
+        }
+        return target.get() == static_cast<const LuaValFrozen&>(other).target.get();
+    }
+
+    std::unique_ptr<LuaValBase> clone() override {
+        return std::make_unique<LuaValFrozen>(target);
+    }
+
+protected:
+    std::shared_ptr<const LuaValBase> target;
+};
+
+// Table with an immutable front frame for readers and the writes of the next frame kept apart.
+// Readers look up the front frame, which only changes when the table is swapped at a tick boundary.
+// Each handle keeps the frame it read until the swap count changes, so reads take no lock.
+// Values are shared between frames, readers get nested tables as read only LuaValFrozen views without a copy.
+// Writes are collected under a mutex. A swap builds the next frame from a copy of the front frame's
+// entry pointers with the written keys replaced, a swap without writes keeps the frame.
+// The userdata is a handle, copying it into tables or channels shares the same frames.
+// LuaHost swaps every double buffered table with swapAll in LuaHost::tick, other programs call swapAll or swap.
+class LuaValDoubleBuffer : public LuaValBase
+{
+public:
+    typedef std::shared_ptr<const LuaValBase> Value;
+    typedef std::unordered_map<Value, Value, MapHash, MapEq> Frame;
+
+    struct State {
+        // Loaded and replaced with std::atomic_load and std::atomic_store
+        std::shared_ptr<const Frame> front;
+        std::atomic<uint64_t> ticks;
+        std::mutex writeMutex;
+        // Values written since the last swap, removed keys map to nullptr
+        Frame written;
+
+        State(std::shared_ptr<const Frame> initial) : front(std::move(initial)), ticks(0), writeMutex(), written() {
+        }
+
+        std::shared_ptr<const Frame> current() const {
+            return std::atomic_load(&front);
+        }
+
+        void write(Value key, Value value) {
+            std::lock_guard guard(writeMutex);
+            written.insert_or_assign(std::move(key), std::move(value));
+        }
+
+        void swap() {
+            std::lock_guard guard(writeMutex);
+            if (!written.empty()) {
+                auto next = std::make_shared<Frame>(*current());
+                for (auto& write : written) {
+                    if (write.second)
+                        next->insert_or_assign(write.first, write.second);
+                    else
+                        next->erase(write.first);
+                }
+                written.clear();
+                std::atomic_store(&front, std::shared_ptr<const Frame>(std::move(next)));
+            }
+            ticks.fetch_add(1, std::memory_order_release);
+        }
+    };
+
+    LuaValDoubleBuffer(std::shared_ptr<State> state) : LuaValBase(), state(std::move(state)), frame(), frameTicks(0) {
+    }
+
+    // Flips the buffers, called by the host between ticks
+    void swap() {
+        state->swap();
+    }
+
+    // Swaps every double buffered table that is still alive
+    static void swapAll() {
+        std::vector<std::shared_ptr<State>> states;
+        {
+            std::lock_guard guard(registryMutex());
+            auto& registered = registry();
+            for (auto it = registered.begin(); it != registered.end();) {
+                if (auto state = it->lock()) {
+                    states.push_back(std::move(state));
+                    ++it;
+                }
+                else {
+                    it = registered.erase(it);
+                }
+            }
+        }
+        for (auto& state : states)
+            state->swap();
+    }
+
+    int Get(lua_State* L, int self_index, int key_index) override {
+        auto klv = AsLuaVal(L, key_index, LOCK_STATUS::NOT_LOCKED);
+        if (!klv)
+            return luaL_argerror(L, key_index, "Table key is nil");
+        const Frame& current = front();
+        // Looked up through a pointer that does not own the key
+        auto it = current.find(Value(Value(), klv.get()));
+        if (it == current.end()) {
+            lua_pushnil(L);
+            return 1;
+        }
+        return LuaValFrozen::push(L, it->second, it->second.get());
+    }
+
+    int Set(lua_State* L, int self_index, int key_index, int val_index) override {
+        auto kk = AsLuaVal(L, key_index, LOCK_STATUS::NOT_LOCKED);
+        auto vv = AsLuaVal(L, val_index, LOCK_STATUS::NOT_LOCKED);
+        if (!kk)
+            return luaL_argerror(L, key_index, "Table key is nil");
+        state->write(Value(std::move(kk)), Value(std::move(vv)));
+        return 0;
+    }
+
+    // Number of swaps so far
+    int Version(lua_State* L, int self_index) override {
+        lua_pushnumber(L, static_cast<lua_Number>(state->ticks.load(std::memory_order_acquire)));
+        return 1;
+    }
+
+    int Swap(lua_State* L, int self_index) override {
+        swap();
+        return 0;
+    }
+
+    // Iterates a table of the front frame's entries, nested tables are returned as views
+    int iterate(lua_State* L, int self_index) override {
+        auto snapshot = snapshotFront();
+        LuaValTable* table = snapshot.get();
+        pushLuaVal(L, snapshot.release(), LUAVAL_METATABLE_KEY);
+        int snapshot_index = lua_gettop(L);
+        int n = LuaValFrozen::pinIterator(L, snapshot_index, table->iterate(L, snapshot_index));
+        lua_remove(L, snapshot_index);
+        return n;
+    }
+
+    int pushAsLua(lua_State* L, uint32_t depth) override {
+        return snapshotFront()->pushAsLua(L, depth);
+    }
+
+    int asObject(lua_State* L) override {
+        return pushLuaVal(L, new LuaValDoubleBuffer(state), LUAVAL_METATABLE_KEY);
+    }
+
+    size_t LuaValHash() const override {
+        return std::hash<State*>{}(state.get());
+    }
+
+    bool lessThan(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return true;
+        }
+        return state.get() < static_cast<const LuaValDoubleBuffer&>(other).state.get();
+    }
+    bool equalTo(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return false;
+        }
+        return state.get() == static_cast<const LuaValDoubleBuffer&>(other).state.get();
+    }
+
+    std::unique_ptr<LuaValBase> clone() override {
+        return std::make_unique<LuaValDoubleBuffer>(state);
+    }
+
+    // Lua functions
+
+    // LuaVal.newDoubleBuffered([table])
+    static int factory(lua_State* L) {
+        auto initial = std::make_shared<Frame>();
+        if (!lua_isnoneornil(L, 1)) {
+            luaL_checktype(L, 1, LUA_TTABLE);
+            lua_pushnil(L);
+            while (lua_next(L, 1)) {
+                auto key = AsLuaVal(L, -2, LOCK_STATUS::NOT_LOCKED);
+                auto value = AsLuaVal(L, -1, LOCK_STATUS::NOT_LOCKED);
+                if (key && value)
+                    initial->emplace(Value(std::move(key)), Value(std::move(value)));
+                lua_pop(L, 1);
+            }
+        }
+        auto state = std::make_shared<State>(std::move(initial));
+        {
+            std::lock_guard guard(registryMutex());
+            registry().push_back(state);
+        }
+        return pushLuaVal(L, new LuaValDoubleBuffer(std::move(state)), LUAVAL_METATABLE_KEY);
+    }
+
+protected:
+    static std::mutex& registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static std::vector<std::weak_ptr<State>>& registry() {
+        static std::vector<std::weak_ptr<State>> states;
+        return states;
+    }
+
+    // Front frame as of the last swap this handle has seen, reloaded when the swap count changed.
+    // Handles belong to one lua state, so only its thread uses the cached frame.
+    const Frame& front() {
+        uint64_t ticks = state->ticks.load(std::memory_order_acquire);
+        if (!frame || ticks != frameTicks) {
+            frame = state->current();
+            frameTicks = ticks;
+        }
+        return *frame;
+    }
+
+    std::unique_ptr<LuaValTable> snapshotFront() {
+        auto snapshot = std::make_unique<LuaValTable>();
+        for (auto& entry : front())
+            snapshot->writeEntry(LuaValFrozen::share(entry.first), LuaValFrozen::share(entry.second));
+        return snapshot;
+    }
+
+    std::shared_ptr<State> state;
+    std::shared_ptr<const Frame> frame;
+    uint64_t frameTicks;
+};
+
+// Reference to a table shared between lua states through LuaValRegistry.
+// Lua functions resolve the reference and work on the shared table directly.
+// Storing the reference in another table copies the shared table like any other LuaVal table.
+class LuaValSharedRef : public LuaValBase
+{
+public:
+    LuaValSharedRef(std::shared_ptr<LuaValBase> target) : LuaValBase(), target(std::move(target)) {
+    }
+
+    LuaValBase* resolve() override {
+        return target.get();
+    }
+
+    int asObject(lua_State* L) override {
+        return pushLuaVal(L, new LuaValSharedRef(target), LUAVAL_METATABLE_KEY);
+    }
+
+    int pushAsLua(lua_State* L, uint32_t depth) override {
+        LOCK_RESULT result = target->lockTable(false);
+        if (result != LOCK_RESULT::ACQUIRED)
+            return lockError(L, result);
+        int n = target->pushAsLua(L, depth);
+        target->unlockTable();
+        return n;
+    }
+
+    size_t LuaValHash() const override {
+        return std::hash<LuaValBase*>{}(target.get());
+    }
+
+    bool lessThan(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return true;
+        }
+        return target.get() < static_cast<const LuaValSharedRef&>(other).target.get();
+    }
+    bool equalTo(const LuaValBase& other) const override {
+        if (typeid(*this) != typeid(other)) {
+            return false;
+        }
+        return target.get() == static_cast<const LuaValSharedRef&>(other).target.get();
+    }
+
+    std::unique_ptr<LuaValBase> clone() override {
+        return std::make_unique<LuaValSharedRef>(target);
+    }
+
+protected:
+    std::shared_ptr<LuaValBase> target;
+};
+
+// Process wide named values returned by LuaVal.shared to every lua state.
+// Tables are created on first use with a locking policy. The host can also publish
+// handles such as channels or double buffered tables under a name before starting the states.
+class LuaValRegistry
+{
+public:
+    // Returns the value named name, creating an empty table locked with status if there is none
+    static std::shared_ptr<LuaValBase> getOrCreate(const std::string& name, LOCK_STATUS status) {
+        std::lock_guard guard(mutex());
+        auto& value = values()[name];
+        if (!value) {
+            value = LuaValVisitLockPolicy(status, [](auto policy) -> std::shared_ptr<LuaValBase> {
+                return std::make_shared<LuaValTableT<typename decltype(policy)::type>>();
+            });
+        }
+        return value;
+    }
+
+    static std::shared_ptr<LuaValBase> find(const std::string& name) {
+        std::lock_guard guard(mutex());
+        auto it = values().find(name);
+        return it == values().end() ? nullptr : it->second;
+    }
+
+    // Tables published here must be locked since every state can reach them
+    static void publish(const std::string& name, std::shared_ptr<LuaValBase> value) {
+        std::lock_guard guard(mutex());
+        values()[name] = std::move(value);
+    }
+
+    static void remove(const std::string& name) {
+        std::lock_guard guard(mutex());
+        values().erase(name);
+    }
+
+    // LuaVal.shared(name [, policy])
+    static int Shared(lua_State* L) {
+        constexpr int name_index = 1;
+        constexpr int policy_index = 2;
+        std::string name = luaL_checkstring(L, name_index);
+        LOCK_STATUS status = LuaValBase::checkLockStatus(L, policy_index, "shared");
+        luaL_argcheck(L, status != LOCK_STATUS::NOT_LOCKED, policy_index, "Shared tables must be locked");
+        auto value = getOrCreate(name, status);
+        if (value->isTable())
+            return LuaValBase::pushLuaVal(L, new LuaValSharedRef(std::move(value)), LuaValBase::LUAVAL_METATABLE_KEY);
+        // Handles push a new handle to the same shared object
+        return value->asObject(L);
+    }
+
+private:
+    static std::mutex& mutex() {
+        static std::mutex registry_mutex;
+        return registry_mutex;
+    }
+    static std::unordered_map<std::string, std::shared_ptr<LuaValBase>>& values() {
+        static std::unordered_map<std::string, std::shared_ptr<LuaValBase>> registry_values;
+        return registry_values;
+    }
+};
+
+// Bulk read operations over a whole table, run on LuaValThreadPool.
+// The calling thread read locks the table and its buckets are split into shards scanned in parallel.
+// Only built in reducers and filters are available since lua code can not run on the pool threads.
+class LuaValBulk
+{
+public:
+    static constexpr size_t SHARDS_PER_THREAD = 4;
+    // Tables with fewer buckets per shard are not worth splitting further
+    static constexpr size_t MIN_SHARD_BUCKETS = 1024;
+
+    // The value an operation looks at, the entry value itself or a field of table values
+    struct Selector {
+        std::unique_ptr<LuaValBase> field;
+
+        const LuaValBase* select(const LuaValBase& value) const {
+            if (!field)
+                return &value;
+            if (!value.isTable())
+                return nullptr;
+            auto entry = value.findEntry(field);
+            return entry ? entry->value.get() : nullptr;
+        }
+    };
+
+    // Filter read from a lua table { field = key, op = '<', value = 10 }, all fields are optional.
+    // Without op the filter compares for equality if value is set and checks existence otherwise.
+    struct Filter {
+        enum OP { EXISTS, EQ, NE, LT, LE, GT, GE };
+
+        Selector selector;
+        OP op = EXISTS;
+        std::unique_ptr<LuaValBase> operand;
+
+        bool matches(const LuaValBase& value) const {
+            const LuaValBase* selected = selector.select(value);
+            if (!selected)
+                return false;
+            switch (op)
+            {
+            case EXISTS:
+                return true;
+            case EQ:
+                return selected->equalTo(*operand);
+            case NE:
+                return !selected->equalTo(*operand);
+            default:
+                break;
+            }
+            // Ordering is only defined between two numbers or two strings
+            if (typeid(*selected) != typeid(*operand))
+                return false;
+            switch (op)
+            {
+            case LT:
+                return selected->lessThan(*operand);
+            case LE:
+                return !operand->lessThan(*selected);
+            case GT:
+                return operand->lessThan(*selected);
+            default:
+                return !selected->lessThan(*operand);
+            }
+        }
+    };
+
+    struct Stats {
+        double sum = 0;
+        double min = 0;
+        double max = 0;
+        size_t count = 0;
+
+        void add(double value) {
+            sum += value;
+            min = count == 0 ? value : (std::min)(min, value);
+            max = count == 0 ? value : (std::max)(max, value);
+            ++count;
+        }
+        void merge(const Stats& other) {
+            if (other.count == 0)
+                return;
+            sum += other.sum;
+            min = count == 0 ? other.min : (std::min)(min, other.min);
+            max = count == 0 ? other.max : (std::max)(max, other.max);
+            count += other.count;
+        }
+    };
+
+    typedef std::pair<double, const LuaValBase*> Ranked;
+
+    static bool asNumber(const LuaValBase* value, double& number) {
+        if (!value || typeid(*value) != typeid(LuaVal<double>))
+            return false;
+        number = static_cast<const LuaVal<double>&>(*value).get();
+        return true;
+    }
+
+    // Calls visit(result, key, value) for every entry, with one result per shard
+    template<typename Result, typename Visit>
+    static std::vector<Result> scan(const LuaValBase& table, Visit&& visit) {
+        auto& pool = LuaValThreadPool::instance();
+        size_t buckets = table.bucketCount();
+        size_t shards = (std::min)((pool.size() + 1) * SHARDS_PER_THREAD, std::max<size_t>(1, buckets / MIN_SHARD_BUCKETS));
+        std::vector<Result> results(shards);
+        pool.parallelFor(shards, [&](size_t shard) {
+            Result& result = results[shard];
+            table.scanBuckets(buckets * shard / shards, buckets * (shard + 1) / shards, [&](const LuaValBase& key, const LuaValBase& value) {
+                visit(result, key, value);
+            });
+        });
+        return results;
+    }
+
+    static LuaValBase* checkTable(lua_State* L, int index) {
+        auto table = LuaValBase::checkLuaVal<LuaValBase>(L, index, LuaValBase::LUAVAL_METATABLE_KEY);
+        if (!table->isTable())
+            luaL_argerror(L, index, "Trying to use non table value as table");
+        return table;
+    }
+
+    static Selector checkSelector(lua_State* L, int index) {
+        Selector selector;
+        if (!lua_isnoneornil(L, index))
+            selector.field = LuaValBase::AsLuaVal(L, index, LOCK_STATUS::NOT_LOCKED);
+        return selector;
+    }
+
+    static Filter checkFilter(lua_State* L, int index) {
+        static const char* const ops[] = { "exists", "==", "~=", "<", "<=", ">", ">=", nullptr };
+        Filter filter;
+        if (lua_isnoneornil(L, index))
+            return filter;
+        luaL_checktype(L, index, LUA_TTABLE);
+        int top = lua_gettop(L);
+        lua_getfield(L, index, "field");
+        lua_getfield(L, index, "op");
+        lua_getfield(L, index, "value");
+        filter.selector = checkSelector(L, top + 1);
+        filter.operand = LuaValBase::AsLuaVal(L, top + 3, LOCK_STATUS::NOT_LOCKED);
+        if (!lua_isnil(L, top + 2))
+            filter.op = static_cast<typename Filter::OP>(luaL_checkoption(L, top + 2, nullptr, ops));
+        else if (filter.operand)
+            filter.op = Filter::EQ;
+        lua_settop(L, top);
+        if (filter.op != Filter::EXISTS && !filter.operand)
+            luaL_argerror(L, index, "Filter needs a value to compare with");
+        if (filter.op >= Filter::LT && typeid(*filter.operand) != typeid(LuaVal<double>) && typeid(*filter.operand) != typeid(LuaVal<std::string>))
+            luaL_argerror(L, index, "Filter can only order numbers and strings");
+        return filter;
+    }
+
+    // Lua functions
+
+    // LuaVal.reduce(table, 'sum'|'min'|'max'|'avg' [, field])
+    static int Reduce(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int op_index = 2;
+        constexpr int field_index = 3;
+        static const char* const ops[] = { "sum", "min", "max", "avg", nullptr };
+        LuaValBase* table = checkTable(L, self_index);
+        int op = luaL_checkoption(L, op_index, nullptr, ops);
+        Selector selector = checkSelector(L, field_index);
+        LOCK_RESULT result = table->lockTable(false);
+        if (result != LOCK_RESULT::ACQUIRED)
+            return LuaValBase::lockError(L, result);
+        Stats stats;
+        for (auto& shard : scan<Stats>(*table, [&](Stats& shard, const LuaValBase& key, const LuaValBase& value) {
+            double number;
+            if (asNumber(selector.select(value), number))
+                shard.add(number);
+        }))
+            stats.merge(shard);
+        table->unlockTable();
+        if (op == 0)
+            lua_pushnumber(L, stats.sum);
+        else if (stats.count == 0)
+            lua_pushnil(L);
+        else
+            lua_pushnumber(L, op == 1 ? stats.min : op == 2 ? stats.max : stats.sum / stats.count);
+        return 1;
+    }
+
+    // LuaVal.count(table [, filter])
+    static int Count(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int filter_index = 2;
+        LuaValBase* table = checkTable(L, self_index);
+        Filter filter = checkFilter(L, filter_index);
+        LOCK_RESULT result = table->lockTable(false);
+        if (result != LOCK_RESULT::ACQUIRED)
+            return LuaValBase::lockError(L, result);
+        size_t count = 0;
+        for (size_t shard : scan<size_t>(*table, [&](size_t& shard, const LuaValBase& key, const LuaValBase& value) {
+            if (filter.matches(value))
+                ++shard;
+        }))
+            count += shard;
+        table->unlockTable();
+        lua_pushnumber(L, static_cast<lua_Number>(count));
+        return 1;
+    }
+
+    // LuaVal.filterKeys(table [, filter]), returns a list of the matching keys
+    static int FilterKeys(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int filter_index = 2;
+        LuaValBase* table = checkTable(L, self_index);
+        Filter filter = checkFilter(L, filter_index);
+        LOCK_RESULT result = table->lockTable(false);
+        if (result != LOCK_RESULT::ACQUIRED)
+            return LuaValBase::lockError(L, result);
+        auto shards = scan<std::vector<const LuaValBase*>>(*table, [&](std::vector<const LuaValBase*>& shard, const LuaValBase& key, const LuaValBase& value) {
+            if (filter.matches(value))
+                shard.push_back(&key);
+        });
+        // Keys point into the table so they are pushed before unlocking
+        lua_newtable(L);
+        int i = 0;
+        for (auto& shard : shards) {
+            for (auto key : shard) {
+                const_cast<LuaValBase*>(key)->asObject(L);
+                lua_rawseti(L, -2, ++i);
+            }
+        }
+        table->unlockTable();
+        return 1;
+    }
+
+    // LuaVal.topN(table, n [, field [, 'desc'|'asc']]), returns a list of keys and a list of their numbers
+    static int TopN(lua_State* L) {
+        constexpr int self_index = 1;
+        constexpr int n_index = 2;
+        constexpr int field_index = 3;
+        constexpr int order_index = 4;
+        static const char* const orders[] = { "desc", "asc", nullptr };
+        LuaValBase* table = checkTable(L, self_index);
+        lua_Integer n = luaL_checkinteger(L, n_index);
+        luaL_argcheck(L, n >= 0, n_index, "Count must not be negative");
+        Selector selector = checkSelector(L, field_index);
+        bool ascending = luaL_checkoption(L, order_index, "desc", orders) == 1;
+        auto better = [ascending](const Ranked& a, const Ranked& b) {
+            return ascending ? a.first < b.first : a.first > b.first;
+        };
+        size_t limit = static_cast<size_t>(n);
+        LOCK_RESULT result = table->lockTable(false);
+        if (result != LOCK_RESULT::ACQUIRED)
+            return LuaValBase::lockError(L, result);
+        // Each shard keeps a heap of its best entries with the worst one on top
+        auto shards = scan<std::vector<Ranked>>(*table, [&](std::vector<Ranked>& heap, const LuaValBase& key, const LuaValBase& value) {
+            double number;
+            if (limit == 0 || !asNumber(selector.select(value), number))
+                return;
+            Ranked ranked(number, &key);
+            if (heap.size() < limit) {
+                heap.push_back(ranked);
+                std::push_heap(heap.begin(), heap.end(), better);
+            }
+            else if (better(ranked, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), better);
+                heap.back() = ranked;
+                std::push_heap(heap.begin(), heap.end(), better);
+            }
+        });
+        std::vector<Ranked> top;
+        for (auto& shard : shards)
+            top.insert(top.end(), shard.begin(), shard.end());
+        size_t count = (std::min)(limit, top.size());
+        std::partial_sort(top.begin(), top.begin() + count, top.end(), better);
+        lua_createtable(L, static_cast<int>(count), 0);
+        lua_createtable(L, static_cast<int>(count), 0);
+        for (size_t i = 0; i < count; ++i) {
+            const_cast<LuaValBase*>(top[i].second)->asObject(L);
+            lua_rawseti(L, -3, static_cast<int>(i + 1));
+            lua_pushnumber(L, top[i].first);
+            lua_rawseti(L, -2, static_cast<int>(i + 1));
+        }
+        table->unlockTable();
+        return 2;
+    }
+};
+
+// Locks a set of tables together. Tables are locked in address order following
+// LuaValLockHierarchy and unlocked in reverse order.
+class LuaValLockSet
+{
+public:
+    LuaValLockSet() : tables(), locked(false) {
+    }
+    ~LuaValLockSet() {
+        unlockAll();
+    }
+    LuaValLockSet(const LuaValLockSet&) = delete;
+    LuaValLockSet& operator=(const LuaValLockSet&) = delete;
+
+    // A table added for reading and writing is locked exclusively
+    void add(LuaValBase* table, bool exclusive) {
+        bool& mode = tables[table];
+        mode = mode || exclusive;
+    }
+
+    // On failure no table is left locked
+    LOCK_RESULT lockAll() {
+        for (auto it = tables.begin(); it != tables.end(); ++it) {
+            LOCK_RESULT result = it->first->lockTable(it->second);
+            if (result != LOCK_RESULT::ACQUIRED) {
+                while (it != tables.begin())
+                    (--it)->first->unlockTable();
+                return result;
+            }
+        }
+        locked = true;
+        return LOCK_RESULT::ACQUIRED;
+    }
+
+    void unlockAll() {
+        if (!locked)
+            return;
+        for (auto it = tables.rbegin(); it != tables.rend(); ++it)
+            it->first->unlockTable();
+        locked = false;
+    }
+
+private:
+    // std::map iterates in address order which is the order of the lock hierarchy
+    std::map<LuaValBase*, bool> tables;
+    bool locked;
+};
+
+// Optimistic transaction over one or more tables.
+// Reads record the version of each entry they see and writes are buffered.
+// On commit all touched tables are locked in address order, the recorded
+// versions are validated and the buffered writes are applied if nothing changed.
+class LuaValTransaction
+{
+public:
+    struct ReadRecord {
+        bool found;
+        uint64_t version;
+        bool operator==(const ReadRecord& other) const {
+            return found == other.found && version == other.version;
+        }
+    };
+    struct TableAccess {
+        std::unordered_map<std::unique_ptr<LuaValBase>, ReadRecord, LuaValBase::MapHash, LuaValBase::MapEq> reads;
+        // nullptr value erases the key on commit
+        std::unordered_map<std::unique_ptr<LuaValBase>, std::unique_ptr<LuaValBase>, LuaValBase::MapHash, LuaValBase::MapEq> writes;
+    };
+
+    static constexpr int DEFAULT_MAX_ATTEMPTS = 100;
+
+    // Error value used to abort the transaction function early when a conflict is seen
+    static void* conflictMarker() {
+        static char marker;
+        return &marker;
+    }
+
+    LuaValTransaction(lua_State* L) : tables(), active(true) {
+        // Tables used by the transaction are referenced here so they stay alive until commit
+        lua_newtable(L);
+        anchorRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    TableAccess& touch(lua_State* L, LuaValBase* table, int table_index) {
+        auto it = tables.find(table);
+        if (it != tables.end())
+            return it->second;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, anchorRef);
+        lua_pushvalue(L, table_index);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+        return tables[table];
+    }
+
+    // Returns false if a read is no longer valid or the tables could not be locked, see lock_result
+    bool commit(LOCK_RESULT& lock_result) {
+        LuaValLockSet locks;
+        for (auto& it : tables)
+            locks.add(it.first, !it.second.writes.empty());
+        lock_result = locks.lockAll();
+        if (lock_result != LOCK_RESULT::ACQUIRED)
+            return false;
+        bool valid = true;
+        for (auto& it : tables) {
+            for (auto& read : it.second.reads) {
+                auto entry = it.first->findEntry(read.first);
+                if (!(read.second == ReadRecord{ entry != nullptr, entry ? entry->version : 0 })) {
+                    valid = false;
+                    break;
+                }
+            }
+            if (!valid)
+                break;
+        }
+        if (valid) {
+            for (auto& it : tables) {
+                auto& writes = it.second.writes;
+                while (!writes.empty()) {
+                    auto node = writes.extract(writes.begin());
+                    it.first->writeEntry(std::move(node.key()), std::move(node.mapped()));
+                }
+            }
+        }
+        return valid;
+    }
+
+    void finish(lua_State* L) {
+        active = false;
+        tables.clear();
+        luaL_unref(L, LUA_REGISTRYINDEX, anchorRef);
+        anchorRef = LUA_NOREF;
+    }
+
+    static LuaValTransaction* checkActive(lua_State* L, int index) {
+        auto tx = LuaValBase::checkLuaVal<LuaValTransaction>(L, index, LuaValBase::LUAVAL_TRANSACTION_METATABLE_KEY);
+        if (!tx->active)
+            luaL_error(L, "Transaction is no longer active");
+        return tx;
+    }
+
+    static LuaValBase* checkTable(lua_State* L, int index) {
+        auto table = LuaValBase::checkLuaVal<LuaValBase>(L, index, LuaValBase::LUAVAL_METATABLE_KEY);
+        if (!table->isTable())
+            luaL_argerror(L, index, "Trying to use non table value as table");
+        return table;
+    }
+
+    // Lua functions
+
+    static int Get(lua_State* L) {
+        constexpr int tx_index = 1;
+        constexpr int table_index = 2;
+        constexpr int key_index = 3;
+        LuaValTransaction* tx = checkActive(L, tx_index);
+        LuaValBase* table = checkTable(L, table_index);
+        if (!tx->read(L, table, table_index, key_index)) {
+            lua_pushlightuserdata(L, conflictMarker());
+            return lua_error(L);
+        }
+        return 1;
+    }
+
+    static int Set(lua_State* L) {
+        constexpr int tx_index = 1;
+        constexpr int table_index = 2;
+        constexpr int key_index = 3;
+        constexpr int val_index = 4;
+        LuaValTransaction* tx = checkActive(L, tx_index);
+        LuaValBase* table = checkTable(L, table_index);
+        if (lua_isnoneornil(L, key_index))
+            return luaL_argerror(L, key_index, "Table key is nil");
+        auto kk = LuaValBase::AsLuaVal(L, key_index, table->lockStatus());
+        auto vv = LuaValBase::AsLuaVal(L, val_index, table->lockStatus());
+        tx->touch(L, table, table_index).writes.insert_or_assign(std::move(kk), std::move(vv));
+        return 0;
+    }
+
+private:
+    // Pushes the value of key as seen by the transaction.
+    // Returns false if the key changed since the transaction last read it.
+    bool read(lua_State* L, LuaValBase* table, int table_index, int key_index) {
+        if (lua_isnoneornil(L, key_index))
+            luaL_argerror(L, key_index, "Table key is nil");
+        auto key = LuaValBase::AsLuaVal(L, key_index, table->lockStatus());
+        TableAccess& access = touch(L, table, table_index);
+        auto written = access.writes.find(key);
+        if (written != access.writes.end()) {
+            if (written->second)
+                written->second->asObject(L);
+            else
+                lua_pushnil(L);
+            return true;
+        }
+        LOCK_RESULT result = table->lockTable(false);
+        if (result != LOCK_RESULT::ACQUIRED)
+            LuaValBase::lockError(L, result);
+        auto entry = table->findEntry(key);
+        ReadRecord record{ entry != nullptr, entry ? entry->version : 0 };
+        if (entry)
+            entry->value->asObject(L);
+        else
+            lua_pushnil(L);
+        table->unlockTable();
+        auto previous = access.reads.find(key);
+        if (previous == access.reads.end()) {
+            access.reads.emplace(std::move(key), record);
+            return true;
+        }
+        return previous->second == record;
+    }
+
+    std::map<LuaValBase*, TableAccess> tables;
+    int anchorRef;
+    bool active;
+};
+
+std::unique_ptr<LuaValBase> LuaValBase::AsLuaVal(lua_State* L, int index, LOCK_STATUS status)
+{
+    auto t = lua_type(L, index);
+    switch (t)
+    {
+    case LUA_TBOOLEAN:
+        return std::make_unique<LuaVal<bool>>(lua_toboolean(L, index) != 0);
+    case LUA_TNIL:
+        [[fallthrough]];
+    case LUA_TNONE:
+        return nullptr;
+    case LUA_TNUMBER:
+        return std::make_unique<LuaVal<double>>(lua_tonumber(L, index));
+    case LUA_TSTRING:
+    {
+        size_t len;
+        const char* cstr = lua_tolstring(L, index, &len);
+        return std::make_unique<LuaVal<std::string>>(std::string(cstr, len));
+    }
+    case LUA_TTABLE:
+    {
+        return LuaValVisitLockPolicy(status, [&](auto policy) -> std::unique_ptr<LuaValBase> {
+            auto m = std::make_unique<LuaValTableT<typename decltype(policy)::type>>();
+            m->FromTable(L, index);
+            return m;
+        });
+    }
+    case LUA_TUSERDATA:
+    {
+        if (isLuaVal(L, index, LUAVAL_METATABLE_KEY))
+        {
+            LuaValBase* lv = getLuaVal<LuaValBase>(L, index);
+            if (!lv)
+                luaL_argerror(L, index, "LuaVal has been moved");
+            lv = lv->resolve();
+            // Locked tables keep their own lock policy when stored in other locked tables,
+            // but tables are converted when moving between locked and not locked tables
+            bool convert = lv->isTable() && (lv->lockStatus() == LOCK_STATUS::NOT_LOCKED) != (status == LOCK_STATUS::NOT_LOCKED);
+            return copyLuaVal(L, index, convert, status);
+        }
+        if (isLuaVal(L, index, LUAVAL_CHANNEL_METATABLE_KEY) || isLuaVal(L, index, LUAVAL_FUTURE_METATABLE_KEY) || isLuaVal(L, index, LUAVAL_ACTOR_METATABLE_KEY))
+        {
+            return getLuaVal<LuaValBase>(L, index)->clone();
+        }
+        [[fallthrough]];
+    }
+    default:
         luaL_argerror(L, index, "Trying to use unsupported type");
     }
     return nullptr;
 }
+
+int LuaValBase::transaction(lua_State* L)
+{
+    constexpr int func_index = 1;
+    constexpr int attempts_index = 2;
+    constexpr int tx_index = 3;
+    luaL_checktype(L, func_index, LUA_TFUNCTION);
+    int max_attempts = static_cast<int>(luaL_optinteger(L, attempts_index, LuaValTransaction::DEFAULT_MAX_ATTEMPTS));
+    lua_settop(L, attempts_index);
+    for (int attempt = 0; attempt < max_attempts; ++attempt)
+    {
+        LuaValTransaction* tx = new LuaValTransaction(L);
+        pushLuaVal(L, tx, LUAVAL_TRANSACTION_METATABLE_KEY);
+        lua_pushvalue(L, func_index);
+        lua_pushvalue(L, tx_index);
+        if (lua_pcall(L, 1, LUA_MULTRET, 0) != 0)
+        {
+            tx->finish(L);
+            if (lua_touserdata(L, -1) != LuaValTransaction::conflictMarker())
+                return lua_error(L);
+        }
+        else
+        {
+            LOCK_RESULT lock_result;
+            bool committed = tx->commit(lock_result);
+            tx->finish(L);
+            if (committed)
+            {
+                lua_remove(L, tx_index);
+                return lua_gettop(L) - attempts_index;
+            }
+            // Out of order locks are retried like conflicts, the other tables may be free next time
+            if (lock_result == LOCK_RESULT::UPGRADE)
+                return lockError(L, lock_result);
+        }
+        lua_settop(L, attempts_index);
+        std::this_thread::yield();
+    }
+    return luaL_error(L, "Transaction failed to commit after %d attempts", max_attempts);
+}
+
+void LuaValWriteCombiner::flushAll()
+{
+    // Copied so no table lock is waited for while holding the registry mutex
+    std::vector<std::shared_ptr<Registration>> tables;
+    {
+        std::lock_guard guard(registryMutex());
+        tables.assign(registry().begin(), registry().end());
+    }
+    // Tables that can not be locked right now keep their writes until the next flush
+    for (auto& table : tables)
+    {
+        std::lock_guard guard(table->mutex);
+        if (table->table)
+            table->table->flushWrites(LuaValLockWait::Clock::now());
+    }
+}
+
+int LuaValBase::Flush(lua_State* L)
+{
+    constexpr int self_index = 1;
+    if (lua_isnoneornil(L, self_index))
+    {
+        LuaValWriteCombiner::flushAll();
+        return 0;
+    }
+    LuaValBase* luaval = checkLuaVal<LuaValBase>(L, self_index, LUAVAL_METATABLE_KEY);
+    LOCK_RESULT result = luaval->flushWrites();
+    if (result != LOCK_RESULT::ACQUIRED)
+        return lockError(L, result);
+    return 0;
+}
+
+int LuaValBase::withLocks(lua_State* L)
+{
+    constexpr int tables_index = 1;
+    constexpr int func_index = 2;
+    constexpr int mode_index = 3;
+    static const char* const modes[] = { "write", "read", nullptr };
+    luaL_checktype(L, tables_index, LUA_TTABLE);
+    luaL_checktype(L, func_index, LUA_TFUNCTION);
+    bool exclusive = luaL_checkoption(L, mode_index, "write", modes) == 0;
+    lua_settop(L, func_index);
+    LOCK_RESULT lock_result;
+    int status = 0;
+    {
+        // The list of tables stays on the stack and keeps the tables alive while they are locked
+        LuaValLockSet locks;
+        for (int i = 1; ; ++i)
+        {
+            lua_rawgeti(L, tables_index, i);
+            if (lua_isnil(L, -1))
+            {
+                lua_pop(L, 1);
+                break;
+            }
+            LuaValBase* table = isLuaVal(L, -1, LUAVAL_METATABLE_KEY) ? getLuaVal<LuaValBase>(L, -1) : nullptr;
+            lua_pop(L, 1);
+            if (table)
+                table = table->resolve();
+            if (!table || !table->isTable())
+                return luaL_argerror(L, tables_index, "Expected a list of LuaVal tables");
+            locks.add(table, exclusive);
+        }
+        lock_result = locks.lockAll();
+        if (lock_result == LOCK_RESULT::ACQUIRED)
+        {
+            lua_pushvalue(L, func_index);
+            status = lua_pcall(L, 0, LUA_MULTRET, 0);
+            locks.unlockAll();
+        }
+    }
+    if (lock_result != LOCK_RESULT::ACQUIRED)
+        return lockError(L, lock_result);
+    if (status != 0)
+        return lua_error(L);
+    return lua_gettop(L) - func_index;
+}
+
+void LuaValBase::registerMetatables(lua_State* L)
+{
+    if (luaL_newmetatable(L, LUAVAL_METATABLE_KEY) == 0)
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "Metatable %s already registered", LUAVAL_METATABLE_KEY);
+        return;
+    }
+    lua_pushstring(L, "__gc");
+    lua_pushcclosure(L, &gc_closure<LuaValBase>, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "asLua");
+    lua_pushcclosure(L, &pushAsLua, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "new");
+    lua_pushcclosure(L, &factory, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "newLocked");
+    lua_pushcclosure(L, &factoryLocked, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "iterate");
+    lua_pushcclosure(L, &iterate, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "getMany");
+    lua_pushcclosure(L, &GetMany, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "setMany");
+    lua_pushcclosure(L, &SetMany, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "tryGet");
+    lua_pushcclosure(L, &TryGet, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "trySet");
+    lua_pushcclosure(L, &TrySet, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "awaitGet");
+    LuaValAwait::pushFunction<&AttemptGet>(L);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "awaitSet");
+    LuaValAwait::pushFunction<&AttemptSet>(L);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "WAITING");
+    lua_pushlightuserdata(L, LuaValAwait::waitToken());
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "setSpinCount");
+    lua_pushcclosure(L, &SetSpinCount, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "version");
+    lua_pushcclosure(L, &Version, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "trackChanges");
+    lua_pushcclosure(L, &TrackChanges, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "changesSince");
+    lua_pushcclosure(L, &ChangesSince, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "channel");
+    lua_pushcclosure(L, &LuaValChannel::factory, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "future");
+    lua_pushcclosure(L, &LuaValFuture::factory, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "whenAll");
+    lua_pushcclosure(L, &LuaValFuture::WhenAll, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "actor");
+    lua_pushcclosure(L, &LuaValActor::factory, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "send");
+    lua_pushcclosure(L, &LuaValActor::Send, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "after");
+    lua_pushcclosure(L, &LuaValTimers::After, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "every");
+    lua_pushcclosure(L, &LuaValTimers::Every, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "cancel");
+    lua_pushcclosure(L, &LuaValTimers::Cancel, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "dispatch");
+    lua_pushcclosure(L, &LuaValFuture::Dispatch, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "newDoubleBuffered");
+    lua_pushcclosure(L, &LuaValDoubleBuffer::factory, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "swap");
+    lua_pushcclosure(L, &Swap, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "shared");
+    lua_pushcclosure(L, &LuaValRegistry::Shared, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "subscribe");
+    lua_pushcclosure(L, &Subscribe, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "transaction");
+    lua_pushcclosure(L, &transaction, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "withLocks");
+    lua_pushcclosure(L, &withLocks, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "combineWrites");
+    lua_pushcclosure(L, &CombineWrites, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "flush");
+    lua_pushcclosure(L, &Flush, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "reduce");
+    lua_pushcclosure(L, &LuaValBulk::Reduce, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "count");
+    lua_pushcclosure(L, &LuaValBulk::Count, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "filterKeys");
+    lua_pushcclosure(L, &LuaValBulk::FilterKeys, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "topN");
+    lua_pushcclosure(L, &LuaValBulk::TopN, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__index");
+    lua_pushcclosure(L, &Get, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__newindex");
+    lua_pushcclosure(L, &Set, 0);
+    lua_rawset(L, -3);
+
+    // Set LuaVal as a global variable
+    lua_setglobal(L, LUAVAL_METATABLE_KEY); // lua_pop(L, 1);
+
+    if (luaL_newmetatable(L, LUAVAL_ITERATOR_METATABLE_KEY) == 0)
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "Metatable %s already registered", LUAVAL_ITERATOR_METATABLE_KEY);
+        return;
+    }
+    lua_pushstring(L, "__gc");
+    lua_pushcclosure(L, &gc_closure<IteratorState>, 0);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    if (luaL_newmetatable(L, LUAVAL_LOCKED_ITERATOR_METATABLE_KEY) == 0)
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "Metatable %s already registered", LUAVAL_LOCKED_ITERATOR_METATABLE_KEY);
+        return;
+    }
+    lua_pushstring(L, "__gc");
+    lua_pushcclosure(L, &gc_closure<IteratorStateLocked>, 0);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    if (luaL_newmetatable(L, LUAVAL_TRANSACTION_METATABLE_KEY) == 0)
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "Metatable %s already registered", LUAVAL_TRANSACTION_METATABLE_KEY);
+        return;
+    }
+    lua_pushstring(L, "__gc");
+    lua_pushcclosure(L, &gc_closure<LuaValTransaction>, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+    lua_pushstring(L, "get");
+    lua_pushcclosure(L, &LuaValTransaction::Get, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "set");
+    lua_pushcclosure(L, &LuaValTransaction::Set, 0);
+    lua_rawset(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    if (luaL_newmetatable(L, LUAVAL_CHANNEL_METATABLE_KEY) == 0)
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "Metatable %s already registered", LUAVAL_CHANNEL_METATABLE_KEY);
+        return;
+    }
+    lua_pushstring(L, "__gc");
+    lua_pushcclosure(L, &gc_closure<LuaValChannel>, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+    lua_pushstring(L, "push");
+    lua_pushcclosure(L, &LuaValChannel::Push, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "pop");
+    lua_pushcclosure(L, &LuaValChannel::Pop, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "tryPop");
+    lua_pushcclosure(L, &LuaValChannel::TryPop, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "awaitPush");
+    LuaValAwait::pushFunction<&LuaValChannel::AttemptPush>(L);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "awaitPop");
+    LuaValAwait::pushFunction<&LuaValChannel::AttemptPop>(L);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "popBatch");
+    lua_pushcclosure(L, &LuaValChannel::PopBatch, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "size");
+    lua_pushcclosure(L, &LuaValChannel::Size, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "capacity");
+    lua_pushcclosure(L, &LuaValChannel::Capacity, 0);
+    lua_rawset(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    if (luaL_newmetatable(L, LUAVAL_FUTURE_METATABLE_KEY) == 0)
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "Metatable %s already registered", LUAVAL_FUTURE_METATABLE_KEY);
+        return;
+    }
+    lua_pushstring(L, "__gc");
+    lua_pushcclosure(L, &gc_closure<LuaValFuture>, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+    lua_pushstring(L, "poll");
+    lua_pushcclosure(L, &LuaValFuture::Poll, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "wait");
+    LuaValAwait::pushFunction<&LuaValFuture::AttemptWait>(L);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "set");
+    lua_pushcclosure(L, &LuaValFuture::SetValues, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "fail");
+    lua_pushcclosure(L, &LuaValFuture::Fail, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "next");
+    lua_pushcclosure(L, &LuaValFuture::Then, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "ready");
+    lua_pushcclosure(L, &LuaValFuture::Ready, 0);
+    lua_rawset(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    if (luaL_newmetatable(L, LUAVAL_ACTOR_METATABLE_KEY) == 0)
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "Metatable %s already registered", LUAVAL_ACTOR_METATABLE_KEY);
+        return;
+    }
+    lua_pushstring(L, "__gc");
+    lua_pushcclosure(L, &gc_closure<LuaValActor>, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+    lua_pushstring(L, "send");
+    lua_pushcclosure(L, &LuaValActor::Send, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "id");
+    lua_pushcclosure(L, &LuaValActor::Id, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "close");
+    lua_pushcclosure(L, &LuaValActor::Close, 0);
+    lua_rawset(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    if (luaL_newmetatable(L, LUAVAL_SUBSCRIPTION_METATABLE_KEY) == 0)
+    {
+        lua_pop(L, 1);
+        luaL_error(L, "Metatable %s already registered", LUAVAL_SUBSCRIPTION_METATABLE_KEY);
+        return;
+    }
+    lua_pushstring(L, "__gc");
+    lua_pushcclosure(L, &gc_closure<LuaValSubscription::Handle>, 0);
+    lua_rawset(L, -3);
+
+    lua_pushstring(L, "__index");
+    lua_newtable(L);
+    lua_pushstring(L, "drain");
+    lua_pushcclosure(L, &LuaValSubscription::Drain, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "pending");
+    lua_pushcclosure(L, &LuaValSubscription::Pending, 0);
+    lua_rawset(L, -3);
+    lua_pushstring(L, "close");
+    lua_pushcclosure(L, &LuaValSubscription::Close, 0);
+    lua_rawset(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
@@ -0,0 +1,462 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex> // std::mutex, std::unique_lock
+#include <shared_mutex> // std::shared_mutex
+#include <condition_variable>
+#include <thread> // std::this_thread::yield
+#include <algorithm> // std::min
+#include <cstdint>
+#include <cstddef>
+#include <functional> // std::less
+#include <vector>
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h> // _mm_pause
+#endif
+
+// Lock policy used by a table, selectable from lua when creating a table
+enum class LOCK_STATUS {
+    LOCKED, // std::shared_mutex
+    NOT_LOCKED,
+    SPIN_LOCKED,
+    READER_BIASED_LOCKED,
+    FAIR_LOCKED,
+};
+
+inline void LuaValCpuRelax()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    _mm_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+// Small number that stays the same for the lifetime of the calling thread.
+// Used to spread threads over striped slots.
+inline size_t LuaValThreadIndex()
+{
+    static std::atomic<size_t> next_index{ 0 };
+    thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+// Busy wait that starts with cpu pauses and falls back to yielding the thread
+class LuaValBackoff
+{
+public:
+    static constexpr uint32_t SPIN_LIMIT = 64;
+
+    void pause()
+    {
+        if (count < SPIN_LIMIT) {
+            ++count;
+            LuaValCpuRelax();
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    uint32_t count = 0;
+};
+
+// Spin-then-park lock acquisition.
+// Guard is std::unique_lock or std::shared_lock constructed with std::defer_lock.
+// The lock is first polled spin_count times. After that the thread parks on the lock,
+// or if a deadline is given, sleeps with exponential backoff until the lock is free or the deadline passes.
+class LuaValLockWait
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // min and max calls are parenthesized against the macros of windows.h, which dirent.h includes on WIN32
+    static constexpr Clock::time_point NO_DEADLINE = (Clock::time_point::max)();
+
+    static Clock::time_point deadlineAfter(double milliseconds)
+    {
+        if (milliseconds <= 0)
+            return Clock::now();
+        return Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(milliseconds));
+    }
+
+    template<typename Guard>
+    static bool acquire(Guard& guard, uint32_t spin_count, Clock::time_point deadline = NO_DEADLINE)
+    {
+        for (uint32_t i = 0; i < spin_count; ++i) {
+            if (guard.try_lock())
+                return true;
+            LuaValCpuRelax();
+        }
+        if (deadline == NO_DEADLINE) {
+            guard.lock();
+            return true;
+        }
+        return poll([&] { return guard.try_lock(); }, deadline);
+    }
+
+    // Retries attempt until it returns true, sleeping with exponential backoff between attempts.
+    // Returns false if the deadline passes first.
+    template<typename Attempt>
+    static bool poll(Attempt&& attempt, Clock::time_point deadline = NO_DEADLINE)
+    {
+        Clock::duration backoff = std::chrono::microseconds(1);
+        const Clock::duration max_backoff = std::chrono::milliseconds(1);
+        while (!attempt()) {
+            auto now = Clock::now();
+            if (now >= deadline)
+                return false;
+            std::this_thread::sleep_for(deadline == NO_DEADLINE ? backoff : std::min<Clock::duration>(backoff, deadline - now));
+            backoff = (std::min)(backoff * 2, max_backoff);
+        }
+        return true;
+    }
+};
+
+// Outcome of taking a table lock from lua
+enum class LOCK_RESULT {
+    ACQUIRED,
+    BUSY, // deadline passed
+    UPGRADE, // thread holds the table for reading and asked to write
+    ORDER, // blocking would break the lock hierarchy
+};
+
+// Lock hierarchy of the tables locked by the current thread.
+// Tables are ordered by address. While a thread holds table locks it may only block on
+// tables ordered after every table it holds, other tables are only tried once so two
+// threads can never wait on each other. Locks the thread already holds are reentrant.
+class LuaValLockHierarchy
+{
+public:
+    enum class ORDER {
+        HELD,
+        UPGRADE,
+        IN_ORDER,
+        OUT_OF_ORDER,
+    };
+
+    static ORDER classify(const void* table, bool exclusive)
+    {
+        bool in_order = true;
+        for (auto& it : held()) {
+            if (it.table == table)
+                return exclusive && !it.exclusive ? ORDER::UPGRADE : ORDER::HELD;
+            if (!std::less<const void*>()(it.table, table))
+                in_order = false;
+        }
+        return in_order ? ORDER::IN_ORDER : ORDER::OUT_OF_ORDER;
+    }
+
+    static bool isHeld(const void* table)
+    {
+        for (auto& it : held())
+            if (it.table == table)
+                return true;
+        return false;
+    }
+
+    static void push(const void* table, bool exclusive)
+    {
+        held().push_back({ table, exclusive, 1 });
+    }
+
+    static void retain(const void* table)
+    {
+        for (auto& it : held())
+            if (it.table == table)
+                ++it.count;
+    }
+
+    // Returns true when the last hold was released and the lock itself must be unlocked
+    static bool release(const void* table, bool& exclusive)
+    {
+        auto& locks = held();
+        for (auto it = locks.rbegin(); it != locks.rend(); ++it) {
+            if (it->table != table)
+                continue;
+            if (--it->count != 0)
+                return false;
+            exclusive = it->exclusive;
+            locks.erase(std::next(it).base());
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Held {
+        const void* table;
+        bool exclusive;
+        uint32_t count;
+    };
+
+    static std::vector<Held>& held()
+    {
+        thread_local std::vector<Held> locks;
+        return locks;
+    }
+};
+
+// Lock policies for LuaValTableT.
+// Each policy is SharedLockable and names the LOCK_STATUS it implements.
+
+// No locking, for tables used by a single lua state
+class LuaValNoLock
+{
+public:
+    static constexpr LOCK_STATUS STATUS = LOCK_STATUS::NOT_LOCKED;
+
+    void lock() {}
+    bool try_lock() { return true; }
+    void unlock() {}
+    void lock_shared() {}
+    bool try_lock_shared() { return true; }
+    void unlock_shared() {}
+};
+
+// General purpose reader writer lock
+class LuaValSharedMutex : public std::shared_mutex
+{
+public:
+    static constexpr LOCK_STATUS STATUS = LOCK_STATUS::LOCKED;
+};
+
+// Test and test-and-set spinlock, readers are exclusive too.
+// Cheapest option for tables with very short critical sections and low contention.
+class LuaValSpinLock
+{
+public:
+    static constexpr LOCK_STATUS STATUS = LOCK_STATUS::SPIN_LOCKED;
+
+    void lock()
+    {
+        LuaValBackoff backoff;
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            while (locked.load(std::memory_order_relaxed))
+                backoff.pause();
+        }
+    }
+    bool try_lock()
+    {
+        return !locked.load(std::memory_order_relaxed) && !locked.exchange(true, std::memory_order_acquire);
+    }
+    void unlock()
+    {
+        locked.store(false, std::memory_order_release);
+    }
+    void lock_shared() { lock(); }
+    bool try_lock_shared() { return try_lock(); }
+    void unlock_shared() { unlock(); }
+
+private:
+    std::atomic<bool> locked{ false };
+};
+
+// Reader biased lock with a reader counter per slot.
+// Threads are spread over the slots so readers on different cores do not share a cache line.
+// Readers only touch their own slot, writers have to wait for every slot to drain.
+// Good for tables that are read from many threads and rarely written.
+class LuaValReaderBiasedLock
+{
+public:
+    static constexpr LOCK_STATUS STATUS = LOCK_STATUS::READER_BIASED_LOCKED;
+    static constexpr size_t SLOTS = 16;
+
+    void lock_shared()
+    {
+        auto& readers = slots[slotIndex()].readers;
+        LuaValBackoff backoff;
+        while (true) {
+            readers.fetch_add(1, std::memory_order_seq_cst);
+            if (!writer.load(std::memory_order_seq_cst))
+                return;
+            readers.fetch_sub(1, std::memory_order_release);
+            while (writer.load(std::memory_order_relaxed))
+                backoff.pause();
+        }
+    }
+    bool try_lock_shared()
+    {
+        auto& readers = slots[slotIndex()].readers;
+        readers.fetch_add(1, std::memory_order_seq_cst);
+        if (!writer.load(std::memory_order_seq_cst))
+            return true;
+        readers.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+    void unlock_shared()
+    {
+        slots[slotIndex()].readers.fetch_sub(1, std::memory_order_release);
+    }
+
+    void lock()
+    {
+        LuaValBackoff backoff;
+        while (writer.exchange(true, std::memory_order_seq_cst)) {
+            while (writer.load(std::memory_order_relaxed))
+                backoff.pause();
+        }
+        for (auto& slot : slots) {
+            while (slot.readers.load(std::memory_order_seq_cst) != 0)
+                backoff.pause();
+        }
+    }
+    bool try_lock()
+    {
+        if (writer.exchange(true, std::memory_order_seq_cst))
+            return false;
+        for (auto& slot : slots) {
+            if (slot.readers.load(std::memory_order_seq_cst) != 0) {
+                writer.store(false, std::memory_order_release);
+                return false;
+            }
+        }
+        return true;
+    }
+    void unlock()
+    {
+        writer.store(false, std::memory_order_release);
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint32_t> readers{ 0 };
+    };
+
+    // A thread always uses the same slot so unlock_shared hits the slot lock_shared used
+    static size_t slotIndex()
+    {
+        return LuaValThreadIndex() % SLOTS;
+    }
+
+    Slot slots[SLOTS];
+    std::atomic<bool> writer{ false };
+};
+
+// Writer preferring lock that is still fair to readers.
+// New readers queue behind waiting writers, but readers that were already waiting
+// when a writer releases the lock are let in before the next writer.
+class LuaValFairLock
+{
+public:
+    static constexpr LOCK_STATUS STATUS = LOCK_STATUS::FAIR_LOCKED;
+
+    void lock_shared()
+    {
+        std::unique_lock guard(mutex);
+        uint64_t phase = writePhase;
+        ++waitingReaders;
+        readersCv.wait(guard, [&] { return !writer && (waitingWriters == 0 || writePhase != phase); });
+        --waitingReaders;
+        ++readers;
+    }
+    bool try_lock_shared()
+    {
+        std::unique_lock guard(mutex);
+        if (writer || waitingWriters != 0)
+            return false;
+        ++readers;
+        return true;
+    }
+    void unlock_shared()
+    {
+        std::unique_lock guard(mutex);
+        if (--readers == 0 && waitingWriters != 0)
+            writersCv.notify_one();
+    }
+
+    void lock()
+    {
+        std::unique_lock guard(mutex);
+        ++waitingWriters;
+        writersCv.wait(guard, [&] { return !writer && readers == 0; });
+        --waitingWriters;
+        writer = true;
+    }
+    bool try_lock()
+    {
+        std::unique_lock guard(mutex);
+        if (writer || readers != 0)
+            return false;
+        writer = true;
+        return true;
+    }
+    void unlock()
+    {
+        std::unique_lock guard(mutex);
+        writer = false;
+        ++writePhase;
+        if (waitingReaders != 0)
+            readersCv.notify_all();
+        else if (waitingWriters != 0)
+            writersCv.notify_one();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable readersCv;
+    std::condition_variable writersCv;
+    uint64_t writePhase = 0;
+    uint32_t readers = 0;
+    uint32_t waitingReaders = 0;
+    uint32_t waitingWriters = 0;
+    bool writer = false;
+};
+
+template<typename Policy>
+struct LuaValLockPolicyTag {
+    typedef Policy type;
+};
+
+// Calls visitor with a LuaValLockPolicyTag of the lock policy implementing status
+template<typename Visitor>
+decltype(auto) LuaValVisitLockPolicy(LOCK_STATUS status, Visitor&& visitor)
+{
+    switch (status)
+    {
+    case LOCK_STATUS::LOCKED:
+        return visitor(LuaValLockPolicyTag<LuaValSharedMutex>{});
+    case LOCK_STATUS::SPIN_LOCKED:
+        return visitor(LuaValLockPolicyTag<LuaValSpinLock>{});
+    case LOCK_STATUS::READER_BIASED_LOCKED:
+        return visitor(LuaValLockPolicyTag<LuaValReaderBiasedLock>{});
+    case LOCK_STATUS::FAIR_LOCKED:
+        return visitor(LuaValLockPolicyTag<LuaValFairLock>{});
+    case LOCK_STATUS::NOT_LOCKED:
+        [[fallthrough]];
+    default:
+        return visitor(LuaValLockPolicyTag<LuaValNoLock>{});
+    }
+}
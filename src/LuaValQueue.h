@@ -0,0 +1,188 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <atomic>
+#include <memory> // std::unique_ptr
+#include <cstddef>
+#include <cstdint>
+
+// Bounded lock-free multi producer multi consumer queue.
+// Each cell carries a sequence number telling whether it is free for the producer
+// or filled for the consumer of a given lap, so producers and consumers only
+// contend on their own position counter.
+// Capacity is rounded up to a power of two of at least 2, a single cell can not tell a filled cell from a free one.
+template<typename T>
+class LuaValMPMCQueue
+{
+public:
+    LuaValMPMCQueue(size_t requested_capacity) : buffer(), mask(0), enqueuePos(0), dequeuePos(0)
+    {
+        // Stops at the largest power of two of size_t, allocating that much fails with bad_alloc
+        size_t capacity = 2;
+        while (capacity < requested_capacity && capacity <= (SIZE_MAX >> 1))
+            capacity <<= 1;
+        mask = capacity - 1;
+        buffer.reset(new Cell[capacity]);
+        for (size_t i = 0; i < capacity; ++i)
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    LuaValMPMCQueue(const LuaValMPMCQueue&) = delete;
+    LuaValMPMCQueue& operator=(const LuaValMPMCQueue&) = delete;
+
+    // Moves value into the queue, value is left untouched if the queue is full
+    bool tryPush(T& value)
+    {
+        Cell* cell;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &buffer[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value)
+    {
+        Cell* cell;
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &buffer[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->data);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const
+    {
+        return mask + 1;
+    }
+
+    // Approximate when the queue is used concurrently
+    size_t size() const
+    {
+        size_t tail = enqueuePos.load(std::memory_order_acquire);
+        size_t head = dequeuePos.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> buffer;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos;
+    alignas(64) std::atomic<size_t> dequeuePos;
+};
+
+// Unbounded lock-free multi producer single consumer queue.
+// Producers swap their node into the head and then link it to the previous one, the consumer
+// follows the links from the tail. A push that has swapped but not linked yet hides the
+// nodes after it from the consumer until it finishes.
+template<typename T>
+class LuaValMPSCQueue
+{
+public:
+    LuaValMPSCQueue() : head(new Node()), tail(head.load(std::memory_order_relaxed))
+    {
+    }
+
+    ~LuaValMPSCQueue()
+    {
+        T value;
+        while (tryPop(value)) {
+        }
+        delete tail;
+    }
+
+    LuaValMPSCQueue(const LuaValMPSCQueue&) = delete;
+    LuaValMPSCQueue& operator=(const LuaValMPSCQueue&) = delete;
+
+    // Called from any thread
+    void push(T value)
+    {
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* previous = head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Only called from the consumer thread
+    bool tryPop(T& value)
+    {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+        // The popped node becomes the new stub
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node*> next{ nullptr };
+        T value;
+    };
+
+    alignas(64) std::atomic<Node*> head;
+    alignas(64) Node* tail;
+};
@@ -0,0 +1,159 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <algorithm> // std::max, std::min
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed size pool of worker threads for bulk operations.
+// The calling thread always takes part in the work, so a pool without workers runs everything inline.
+class LuaValThreadPool
+{
+public:
+    explicit LuaValThreadPool(size_t threads) : workers(), mutex(), cv(), tasks(), stopping(false)
+    {
+        workers.reserve(threads);
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~LuaValThreadPool()
+    {
+        {
+            std::unique_lock guard(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    LuaValThreadPool(const LuaValThreadPool&) = delete;
+    LuaValThreadPool& operator=(const LuaValThreadPool&) = delete;
+
+    // Process wide pool with a worker per core besides the calling thread
+    static LuaValThreadPool& instance()
+    {
+        static LuaValThreadPool pool((std::max)(1u, std::thread::hardware_concurrency()) - 1);
+        return pool;
+    }
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+    // Runs task(i) for every i in [0, count) and returns when all calls finished.
+    // Indices are handed out one at a time so uneven shards balance out.
+    template<typename Task>
+    void parallelFor(size_t count, Task&& task)
+    {
+        if (count == 0)
+            return;
+        // Helpers can start after the work is done, the batch outlives this call for them
+        auto batch = std::make_shared<Batch>(count);
+        auto run = [batch, &task] {
+            size_t i;
+            while ((i = batch->next.fetch_add(1, std::memory_order_relaxed)) < batch->count) {
+                task(i);
+                batch->finish();
+            }
+        };
+        size_t helpers = (std::min)(workers.size(), count - 1);
+        if (helpers != 0) {
+            {
+                std::unique_lock guard(mutex);
+                for (size_t i = 0; i < helpers; ++i)
+                    tasks.emplace_back(run);
+            }
+            if (helpers == 1)
+                cv.notify_one();
+            else
+                cv.notify_all();
+        }
+        run();
+        batch->wait();
+    }
+
+private:
+    struct Batch {
+        explicit Batch(size_t count) : count(count), next(0), remaining(count), mutex(), done() {
+        }
+
+        void finish()
+        {
+            if (remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+            std::unique_lock guard(mutex);
+            done.notify_all();
+        }
+
+        void wait()
+        {
+            std::unique_lock guard(mutex);
+            done.wait(guard, [this] { return remaining.load(std::memory_order_acquire) == 0; });
+        }
+
+        const size_t count;
+        std::atomic<size_t> next;
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    void workerLoop()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock guard(mutex);
+                cv.wait(guard, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    bool stopping;
+};
@@ -0,0 +1,224 @@
+// BSD-3-Clause Copyright (c) 2022, Rochet2 <rochet2@post.com> All rights
+// reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its contributors
+//   may be used to endorse or promote products derived from this software
+//   without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <algorithm> // std::max
+#include <cstddef>
+#include <cstdint>
+#include <iterator> // std::begin
+#include <memory> // std::unique_ptr
+#include <unordered_map>
+#include <vector>
+
+// Hierarchical timer wheel with one tick resolution.
+// Each level has SLOTS slots covering SLOTS times the range of the level below it.
+// A timer is placed on the lowest level whose range covers its delay and moves down a level
+// each time the wheel passes the start of its slot, so adding and cancelling are O(1)
+// and advancing costs one slot per tick plus the timers that expire or move.
+template<typename Payload>
+class LuaValTimerWheel
+{
+public:
+    static constexpr unsigned LEVELS = 4;
+    static constexpr unsigned SLOT_BITS = 8;
+    static constexpr uint64_t SLOTS = uint64_t(1) << SLOT_BITS;
+    static constexpr uint64_t MAX_DELAY = (uint64_t(1) << (LEVELS * SLOT_BITS)) - 1;
+
+    struct Expired {
+        uint64_t id;
+        Payload payload;
+        bool periodic;
+    };
+
+    LuaValTimerWheel() : current(0), nextId(1), timers(), slots()
+    {
+    }
+
+    LuaValTimerWheel(const LuaValTimerWheel&) = delete;
+    LuaValTimerWheel& operator=(const LuaValTimerWheel&) = delete;
+
+    uint64_t now() const
+    {
+        return current;
+    }
+
+    size_t size() const
+    {
+        return timers.size();
+    }
+
+    bool contains(uint64_t id) const
+    {
+        return timers.find(id) != timers.end();
+    }
+
+    // Adds a timer expiring delay ticks from now, then every period ticks if period is not 0.
+    // Delays are clamped to [1, MAX_DELAY].
+    uint64_t add(uint64_t delay, uint64_t period, Payload payload)
+    {
+        auto timer = std::make_unique<Timer>();
+        timer->id = nextId++;
+        timer->due = current + clampDelay(delay);
+        timer->period = period ? clampDelay(period) : 0;
+        timer->payload = std::move(payload);
+        link(timer.get());
+        uint64_t id = timer->id;
+        timers.emplace(id, std::move(timer));
+        return id;
+    }
+
+    // Removes a pending timer and returns its payload, returns false if there is none with the id
+    bool cancel(uint64_t id, Payload& payload)
+    {
+        auto it = timers.find(id);
+        if (it == timers.end())
+            return false;
+        unlink(it->second.get());
+        payload = std::move(it->second->payload);
+        timers.erase(it);
+        return true;
+    }
+
+    // Removes every timer
+    void clear()
+    {
+        timers.clear();
+        for (auto& level : slots)
+            std::fill(std::begin(level), std::end(level), nullptr);
+    }
+
+    // Advances the wheel to tick and appends the timers that expired on the way in expiry order.
+    // Periodic timers are rescheduled and stay in the wheel until cancelled.
+    void advance(uint64_t tick, std::vector<Expired>& expired)
+    {
+        while (current < tick)
+        {
+            if (timers.empty())
+            {
+                current = tick;
+                return;
+            }
+            ++current;
+            for (unsigned level = 1; level < LEVELS; ++level)
+            {
+                // Entering a new slot of a level moves its timers down
+                if (slotIndex(current, level - 1) != 0)
+                    break;
+                cascade(level, slotIndex(current, level));
+            }
+            Timer* timer = slots[0][slotIndex(current, 0)];
+            while (timer)
+            {
+                Timer* next = timer->next;
+                unlink(timer);
+                if (timer->period)
+                {
+                    expired.push_back({ timer->id, timer->payload, true });
+                    timer->due = current + timer->period;
+                    link(timer);
+                }
+                else
+                {
+                    auto it = timers.find(timer->id);
+                    expired.push_back({ timer->id, std::move(timer->payload), false });
+                    timers.erase(it);
+                }
+                timer = next;
+            }
+        }
+    }
+
+private:
+    struct Timer {
+        uint64_t id;
+        uint64_t due;
+        uint64_t period;
+        Payload payload;
+        Timer* prev = nullptr;
+        Timer* next = nullptr;
+        unsigned level = 0;
+        size_t slot = 0;
+    };
+
+    static uint64_t clampDelay(uint64_t delay)
+    {
+        return (std::min)(std::max<uint64_t>(delay, 1), MAX_DELAY);
+    }
+
+    static size_t slotIndex(uint64_t tick, unsigned level)
+    {
+        return static_cast<size_t>((tick >> (level * SLOT_BITS)) & (SLOTS - 1));
+    }
+
+    void link(Timer* timer)
+    {
+        uint64_t delta = timer->due - current;
+        unsigned level = 0;
+        while (level + 1 < LEVELS && delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS)))
+            ++level;
+        timer->level = level;
+        timer->slot = slotIndex(timer->due, level);
+        Timer*& head = slots[level][timer->slot];
+        timer->prev = nullptr;
+        timer->next = head;
+        if (head)
+            head->prev = timer;
+        head = timer;
+    }
+
+    void unlink(Timer* timer)
+    {
+        if (timer->prev)
+            timer->prev->next = timer->next;
+        else
+            slots[timer->level][timer->slot] = timer->next;
+        if (timer->next)
+            timer->next->prev = timer->prev;
+        timer->prev = nullptr;
+        timer->next = nullptr;
+    }
+
+    void cascade(unsigned level, size_t slot)
+    {
+        Timer* timer = slots[level][slot];
+        slots[level][slot] = nullptr;
+        while (timer)
+        {
+            Timer* next = timer->next;
+            link(timer);
+            timer = next;
+        }
+    }
+
+    uint64_t current;
+    uint64_t nextId;
+    std::unordered_map<uint64_t, std::unique_ptr<Timer>> timers;
+    Timer* slots[LEVELS][SLOTS];
+};
@@ -4,6 +4,8 @@
 #include "sol.h"
 
 #include "LuaVal.h"
+#include "LuaHost.h"
+#include "LuaHotReload.h"
 
 int main() {
 	try {
@@ -13,7 +15,18 @@ int main() {
 		LuaValBase::registerMetatables(state);
 		// LuaVal<false>::registerMetatables(state);
 
-		// Could use dirent here to find lua files from a directory tree to execute
+		// Bytecode of unchanged scripts and modules is reused from the cache directory on later starts
+		LuaBytecodeCache bytecode_cache(".luacache");
+
+		// Modules are indexed once and compiled on their first require, from the bundle made by the
+		// module_bundle target or otherwise from the modules directory tree
+		auto module_index = std::make_shared<LuaModuleIndex>();
+		auto module_bundle = std::make_shared<LuaScriptBundle>();
+		if (module_bundle->open("modules.luab"))
+			module_index->addBundle(module_bundle);
+		else
+			module_index->addTree("modules", &bytecode_cache);
+		module_index->install(state);
 
 		state.script("print('1hello from lua!!')");
 		// state.script("print(require('LuaVal'), 'a')");
@@ -50,6 +63,79 @@ int main() {
 		state.script("print(LVMT.new({}).iterate)");
 		state.script("print(LVMT.new({ iterate = 5 }).iterate)");
 		state.script("b = LVMT.new({ x = 5 }); b.y = LVMT.newLocked({ y = 10 }); print(b.x, b.y, b.y.y)");
+		state.script("acc = LVMT.newLocked({ gold = 100 }); inv = LVMT.newLocked({ gold = 5 })");
+		state.script("print(LVMT.transaction(function(tx) tx:set(acc, 'gold', tx:get(acc, 'gold') - 10); tx:set(inv, 'gold', tx:get(inv, 'gold') + 10); return 'committed' end), acc.gold, inv.gold)");
+		state.script("LVMT.setMany(acc, { hp = 50, mp = 20, name = 'hero' }); print(LVMT.getMany(acc, 'gold', 'hp', 'mp', 'name', 'missing'))");
+		state.script("LVMT.setSpinCount(acc, 100); print(LVMT.trySet(acc, 'gold', 80, 5), LVMT.tryGet(acc, 'gold'))");
+		state.script("for _, policy in ipairs({ 'shared', 'spin', 'reader', 'fair', 'none' }) do local t = LVMT.newLocked({ x = { y = policy } }, policy); t.z = 1; print(policy, t.x.y, t.z) end");
+		state.script("LVMT.trackChanges(acc); local seen = LVMT.version(acc); acc.gold = 1; acc.hp = nil; local changed, now = LVMT.changesSince(acc, seen); print(seen, now, #changed, changed[1], changed[2])");
+		state.script("ch = LVMT.channel(8); ch:push({ event = 'spawn', id = 1 }); ch:push(LVMT.new({ event = 'despawn', id = 2 })); ch:push('ping'); print(ch:size(), ch:pop().event, #ch:popBatch(), ch:tryPop())");
+		state.script("sub = LVMT.subscribe(acc, 'g'); acc.gold = 2; acc.mp = 1; acc.gold = nil; for _, ev in ipairs(sub:drain()) do print(ev.key, ev.old, ev.new) end; sub:close()");
+		state.script("print(LVMT.withLocks({ inv, acc }, function() acc.gold = acc.gold + inv.gold; inv.gold = 0; for k, v in LVMT.iterate(acc) do end; return acc.gold end), inv.gold)");
+		state.script("units = LVMT.newLocked({}); for i = 1, 1000 do units['u' .. i] = { hp = i % 100, team = i % 2 == 0 and 'red' or 'blue' } end");
+		state.script("print(LVMT.reduce(units, 'sum', 'hp'), LVMT.reduce(units, 'max', 'hp'), LVMT.count(units, { field = 'team', value = 'red' }), #LVMT.filterKeys(units, { field = 'hp', op = '<', value = 5 }))");
+		state.script("local keys, hps = LVMT.topN(units, 3, 'hp'); print(keys[1], hps[1], hps[3])");
+		state.script("hits = LVMT.newLocked({ total = 0 }); LVMT.combineWrites(hits, 'sum'); for i = 1, 10 do hits.total = 1 end; print(hits.total); LVMT.flush(hits); print(hits.total); LVMT.combineWrites(hits, 'off')");
+		state.script("world = LVMT.newDoubleBuffered({ tick = 0 }); world.tick = 1; print(world.tick, LVMT.version(world)); LVMT.swap(world); print(world.tick, LVMT.version(world)); for k, v in LVMT.iterate(world) do print(k, v) end");
+
+		auto prepared = std::make_shared<LuaStateTemplate>();
+		prepared->addModule("dice", "local dice = {}; function dice.roll(n) local sum = 0; for i = 1, n do sum = sum + i end; return sum end; return dice");
+		prepared->addConfig("config", "return { workers = 4, spawn = { x = 10, y = 20 } }");
+		prepared->addSetup([module_index](lua_State* L, std::string* error) { return module_index->install(L, error); });
+		prepared->addScript("roll = require('dice').roll", "=init");
+		// The lua files of the scripts directory tree run on the worker states, compiled in parallel and run in path order.
+		// A bundle made by the script_bundle target is used as is, otherwise the tree is compiled.
+		LuaScriptBundle script_bundle;
+		std::string scripts_error;
+		if (script_bundle.open("scripts.luab"))
+			script_bundle.addTo(*prepared);
+		else if (!LuaScriptLoader::addTree("scripts", *prepared, &scripts_error, &bytecode_cache))
+			std::cout << scripts_error << std::endl;
+		for (lua_State* spawned : prepared->newStates(4))
+		{
+			luaL_dostring(spawned, "print('template roll', roll(10), config.spawn.x)");
+			lua_close(spawned);
+		}
+		{
+			LuaHost host(4, prepared);
+			// Edited modules and scripts are recompiled in the background and swapped into the workers,
+			// which loaded the scripts tree through the template
+			LuaHotReload reloader(module_index, &bytecode_cache);
+			reloader.watch("modules", LuaHotReload::MODULES);
+			reloader.watch("scripts", LuaHotReload::SCRIPTS);
+			reloader.attach(host);
+			std::string reload_error;
+			if (!reloader.start(&reload_error))
+				std::cout << reload_error << std::endl;
+			host.runScriptOnAll("local hits = LuaVal.shared('hits'); for i = 1, 1000 do LuaVal.transaction(function(tx) tx:set(hits, 'n', (tx:get(hits, 'n') or 0) + 1) end) end");
+			host.wait();
+			// Ends the frame, double buffered tables show this frame's writes from here on
+			host.tick();
+			host.registerLua(state);
+			state.script("local rolls = {}; for i = 1, 8 do rolls[i] = LuaHost.spawn('roll', i * 100) end; for i, f in ipairs(rolls) do print('roll', i, f:wait()) end");
+			state.script("print('task', LuaHost.spawn(function(t) return t.a + t.b, LuaHost.worker() end, { a = 1, b = 2 }):wait())");
+			host.runScript(0, "local ch = LuaVal.channel(1); LuaHost.go(function() for i = 1, 3 do print('received', ch:awaitPop()) end end); LuaHost.go(function() for i = 1, 3 do ch:awaitPush(i) end; print('awaited', LuaVal.awaitGet(LuaVal.shared('hits'), 'n')) end)");
+			host.wait();
+			host.runScript(2, "local done, ticks = LuaVal.future(), 0; LuaVal.every(5, function(id) ticks = ticks + 1; if ticks == 3 then LuaVal.cancel(id); done:set(ticks) end end); LuaVal.after(10, function() print('after 10ms') end); LuaHost.go(function() print('timer ticks', done:wait()) end)");
+			host.runScript(1, "LuaHost.go(function() local rolls = {}; for i = 1, 4 do rolls[i] = LuaHost.spawn('roll', i * 10) end; print('whenAll', LuaVal.whenAll(rolls):wait()) end)");
+			host.wait();
+			host.runScript(3, "LuaVal.shared('actors').echo = LuaVal.actor(function(msg, id) print('actor', id, 'got', msg.text) end)");
+			host.wait();
+			host.runScriptOnAll("LuaVal.send(LuaVal.shared('actors').echo, { text = 'hi from ' .. LuaHost.worker() })");
+			host.wait();
+			host.runScript(0, "for i = 1, 100 do LuaHost.go(function() end) end");
+			host.wait();
+			host.runScript(0, "for i = 1, 100 do LuaHost.go(function() end) end; LuaHost.go(function() local stats = LuaHost.coroutineStats(); print('coroutine pool', stats.hits, stats.created, stats.idle) end)");
+			host.wait();
+			host.restartWorker(1);
+			host.runScript(1, "print('restarted', roll(3), LuaVal.shared('hits').n)");
+			host.wait();
+			state.script("LuaHost = nil");
+		}
+		state.script("print('shared hits', LVMT.shared('hits').n)");
+		state.script("print('module index', pcall(require, 'not.indexed'))");
+		state.script("local f = LVMT.future(); local sum = f:next(function(a, b) return a + b end); f:set(2, 3); print(sum:ready(), LVMT.dispatch(), sum:poll())");
+
 		state.script("collectgarbage('step')");
 		state.script("collectgarbage('step')");
 		state.script("collectgarbage('step')");
@@ -0,0 +1,29 @@
+// Packs the lua scripts of a directory tree into a precompiled bundle
+// Usage: lua_bundle <script root> <bundle file>
+
+#include <iostream>
+
+// LuaVal expects sol's compat layer for the Lua versions it supports, like main.cpp
+#include "sol.h"
+
+#include "LuaVal.h"
+#include "LuaScriptBundle.h"
+
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <script root> <bundle file>" << std::endl;
+		return 2;
+	}
+	std::string error;
+	if (!LuaScriptBundle::build(argv[1], argv[2], &error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+	LuaScriptBundle bundle;
+	if (!bundle.open(argv[2], &error)) {
+		std::cerr << error << std::endl;
+		return 1;
+	}
+	std::cout << "Bundled " << bundle.entries().size() << " scripts from " << argv[1] << " into " << argv[2] << std::endl;
+	return 0;
+}